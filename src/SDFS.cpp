@@ -24,8 +24,14 @@
  License along with this library; if not, write to the Free Software
  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
  */
+#include <algorithm>
+#include <new>
 #include "SDFS.h"
 #include "SDFSFormatter.h"
+#include "SDFSPack.h"
+#include "SDFSDirIndex.h"
+#include "SDFSCompress.h"
+#include "SDFSChecksum.h"
 #include <FS.h>
 
 //using namespace fs;
@@ -37,6 +43,1012 @@ fs::FS SDFS = fs::FS(fs::FSImplPtr(new sdfs::SDFSImpl()));
 
 namespace sdfs {
 
+// Remember a handle so end() can release it, dropping any that are gone
+template <typename T, typename U>
+static void _trackHandle(std::vector<std::weak_ptr<T>> &list, const std::shared_ptr<U> &ptr)
+{
+    for (auto it = list.begin(); it != list.end(); ) {
+        if (it->expired()) {
+            it = list.erase(it);
+        } else {
+            ++it;
+        }
+    }
+    list.push_back(ptr);
+}
+
+// Forwards to fatToTimeT(), see SDFSTime.h
+time_t SDFSImpl::FatToTimeT(uint16_t d, uint16_t t)
+{
+    return fatToTimeT(d, t);
+}
+
+void SDFSImpl::dateTimeCB(uint16_t* date, uint16_t* time, uint8_t* ms10)
+{
+    static time_t   cachedT = (time_t)-1;
+    static uint16_t cachedDate, cachedTime;
+    time_t t = now();
+    if (t != cachedT) {
+        // One breakTime() instead of one per field
+        tmElements_t te;
+        breakTime(t, te);
+        cachedDate = FS_DATE(tmYearToCalendar(te.Year), te.Month, te.Day);
+        cachedTime = FS_TIME(te.Hour, te.Minute, te.Second);
+        cachedT = t;
+    }
+    *date = cachedDate;
+    *time = cachedTime;
+    // FS_TIME keeps even seconds, the odd one goes in the 10 ms units
+    *ms10 = (t & 1) ? 100 : 0;
+}
+
+bool SDFSImpl::begin()
+{
+    if (_mounted) {
+        end();
+    }
+#if SDFS_BLOCK_DEVICE
+    // Nothing to queue on a read-only mount, just sectors to keep
+    _io.setReadOnly(_cfg._readOnly);
+    if (!(_cfg._readOnly ? _io.scheduler()->begin(0, 0, _cfg._readCache)
+                         : _io.scheduler()->begin(_cfg._schedSectors, _cfg._schedDelay))) {
+        DEBUGV("SDFSImpl::begin() no memory for the I/O scheduler\n");
+    }
+#endif
+    if(_cfg._sdioConfig) {
+        _mounted = _beginCard(*_cfg._sdioConfig);
+        if (!_mounted && _cfg._autoFormat && !_cfg._readOnly) {
+            format();
+            _mounted = _beginCard(*_cfg._sdioConfig);
+        }
+    } else if (_cfg._spiConfig) {
+        _mounted = _beginCard(*_cfg._spiConfig);
+        if (!_mounted && _cfg._autoFormat && !_cfg._readOnly) {
+            format();
+            _mounted = _beginCard(*_cfg._spiConfig);
+        }
+    }
+    if (!_cfg._readOnly) {
+        // Nothing gets a timestamp on a read-only mount
+        FsDateTime::setCallback(dateTimeCB);
+    }
+#if SDFS_BLOCK_DEVICE
+    if (_mounted) {
+        _io.setLayout(_fs.fatStartSector(), _fs.fatStartSector() + _fs.fatCount() * _fs.sectorsPerFat(),
+                      _fs.dataStartSector());
+    }
+#endif
+    _freeClusters = -1;
+    _eraseZero = -1;
+    if (_mounted && _cfg._warmRemount && _restoreWarmState()) {
+        DEBUGV("SDFSImpl::begin() warm remount, free=%d\n", _freeClusters);
+    }
+    _warm.valid = false;
+    if (_mounted && !_cfg._readOnly) {
+        // Sidecars closed cleanly by end() load without a rebuild.  A
+        // read-only mount leaves them unloaded and scans directories.
+        for (auto &idx : _dirIndexes) {
+            idx->begin();
+        }
+    }
+    return _mounted;
+}
+
+void SDFSImpl::end()
+{
+    if (!_mounted) {
+        return;
+    }
+    // Anything still open would be left pointing at a dead volume, so
+    // write it out and close it now.  The owners' objects stay valid and
+    // just report themselves as closed.  Newest first, so compressed
+    // wrappers get flushed before the files underneath them.
+    for (auto it = _openFiles.rbegin(); it != _openFiles.rend(); ++it) {
+        auto f = it->lock();
+        if (f) {
+            f->close();
+        }
+    }
+    for (auto &w : _openDirs) {
+        auto d = w.lock();
+        if (d) {
+            d->close();
+        }
+    }
+    for (auto &p : _packs) {
+        p->close();
+    }
+    _packs.clear();
+    for (auto &idx : _dirIndexes) {
+        idx->close();
+    }
+    _openFiles.clear();
+    _openDirs.clear();
+    _checksumFiles.clear();
+    if (_cfg._warmRemount) {
+        _saveWarmState();
+    }
+#if SDFS_BLOCK_DEVICE
+    _io.scheduler()->end();
+#endif
+    _fs.end();
+    _mounted = false;
+}
+
+// Make sure the card holds everything SdFat and the scheduler are sitting
+// on, before going to it directly
+bool SDFSImpl::_rawSync()
+{
+    if (!_fs.cacheClear()) {
+        return false;
+    }
+#if SDFS_BLOCK_DEVICE
+    return _io.scheduler()->flush();
+#else
+    return true;
+#endif
+}
+
+// Sector reads below SdFat but still through the scheduler and counters
+bool SDFSImpl::_readSectors(uint32_t sector, uint8_t *dst, size_t ns)
+{
+#if SDFS_BLOCK_DEVICE
+    return _io.readSectors(sector, dst, ns);
+#else
+    return (ns == 1) ? _fs.card()->readSector(sector, dst) : _fs.card()->readSectors(sector, dst, ns);
+#endif
+}
+
+// Erases go straight to the card, so the read cache has to drop the
+// sectors they cover by hand
+bool SDFSImpl::_eraseSectors(uint32_t first, uint32_t last)
+{
+    if (!_writable("_eraseSectors") || !_rawSync()) {
+        return false;
+    }
+#if SDFS_BLOCK_DEVICE
+    _io.scheduler()->forget(first, last - first + 1);
+#endif
+    return SDFSFormatter::eraseRange(_fs.card(), first, last);
+}
+
+// SdFat doesn't say where the volume starts, so look for the boot
+// sector whose reserved area ends where the FATs begin: either sector 0
+// on a card without a partition table, or one of the MBR's partitions.
+// Returns the FAT32 FSInfo sector it names, or 0.
+uint32_t SDFSImpl::_fsInfoSector()
+{
+    uint8_t mbr[512], boot[512];
+    if ((_fs.fatType() != 32) || !_rawSync() || !_readSectors(0, mbr, 1)) {
+        return 0;
+    }
+    for (int i = -1; i < 4; i++) {
+        uint32_t start = 0;
+        if (i >= 0) {
+            const uint8_t *p = mbr + 446 + i * 16 + 8;
+            start = (uint32_t)p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+        }
+        if (!start && (i >= 0)) {
+            continue;
+        }
+        const uint8_t *bs = start ? boot : mbr;
+        if (start && !_readSectors(start, boot, 1)) {
+            return 0;
+        }
+        uint16_t bytesPerSector = bs[11] | (bs[12] << 8);
+        uint16_t reserved = bs[14] | (bs[15] << 8);
+        uint16_t fsInfo = bs[48] | (bs[49] << 8);
+        if ((bs[510] == 0x55) && (bs[511] == 0xaa) && (bytesPerSector == 512) &&
+            (start + reserved == _fs.fatStartSector()) && fsInfo && (fsInfo < reserved)) {
+            return start + fsInfo;
+        }
+    }
+    return 0;
+}
+
+// Cheap fingerprint of the volume metadata: the FAT32 FSInfo sector, the
+// first FAT sector and the first root directory sector.  FSInfo holds the
+// free cluster count and the next free hint, which Windows, Linux and
+// macOS bring up to date when they flush or unmount a volume they wrote,
+// wherever on it the clusters were.  SdFat doesn't update it, so our own
+// sessions leave it alone.  Another host that doesn't keep FSInfo (or leaves it marked
+// unknown) and only changes clusters and directories we don't hash goes
+// unnoticed, which is why warm remount is opt in.
+uint32_t SDFSImpl::_signature(uint32_t fsInfo)
+{
+    uint8_t sector[512];
+    uint32_t h = 2166136261UL;
+    uint32_t sectors[3];
+    sectors[0] = fsInfo;
+    sectors[1] = _fs.fatStartSector();
+    // FAT32 gives the root directory's first cluster
+    sectors[2] = _fs.dataStartSector() + (_fs.rootDirStart() - 2) * _fs.sectorsPerCluster();
+    if (!fsInfo || !_rawSync()) {
+        return 0;
+    }
+    for (size_t i = 0; i < sizeof(sectors) / sizeof(sectors[0]); i++) {
+        if (!_readSectors(sectors[i], sector, 1)) {
+            return 0;
+        }
+        h = _hash(sector, sizeof(sector), h);
+    }
+    return h;
+}
+
+// FAT12 and FAT16 have no FSInfo, and their FATs are small enough that
+// the free count is cheap to rebuild, so only FAT32 keeps a warm state
+void SDFSImpl::_saveWarmState()
+{
+    _warm.fatType           = _fs.fatType();
+    _warm.sectorsPerCluster = _fs.sectorsPerCluster();
+    _warm.clusterCount      = _fs.clusterCount();
+    _warm.fatStartSector    = _fs.fatStartSector();
+    _warm.dataStartSector   = _fs.dataStartSector();
+    _warm.fsInfoSector      = _fsInfoSector();
+    _warm.freeClusters      = _freeClusters;
+    _warm.signature         = _signature(_warm.fsInfoSector);
+    _warm.valid             = _warm.signature != 0;
+}
+
+bool SDFSImpl::_restoreWarmState()
+{
+    if (!_warm.valid) {
+        return false;
+    }
+    if ((_warm.fatType != _fs.fatType()) ||
+        (_warm.sectorsPerCluster != _fs.sectorsPerCluster()) ||
+        (_warm.clusterCount != _fs.clusterCount()) ||
+        (_warm.fatStartSector != _fs.fatStartSector()) ||
+        (_warm.dataStartSector != _fs.dataStartSector())) {
+        DEBUGV("SDFSImpl::begin() volume geometry changed, cold mount\n");
+        return false;
+    }
+    if (_signature(_warm.fsInfoSector) != _warm.signature) {
+        DEBUGV("SDFSImpl::begin() volume signature changed, cold mount\n");
+        return false;
+    }
+    _freeClusters = _warm.freeClusters;
+    return true;
+}
+
+// A new directory entry can only have grown its directory if it landed
+// at the start of a cluster, so only then do we lose track of the free
+// count.  dirIndex is the last entry of the name's set, and the whole set
+// is at most MAX_ENTRY_SET entries, so if the set spilled into a freshly
+// added cluster the last entry sits within that many of its start.
+void SDFSImpl::_trackCreate(::File &fd)
+{
+    uint32_t offset = (uint32_t)fd.dirIndex() * 32;
+    if ((offset % (_fs.sectorsPerCluster() * 512)) < MAX_ENTRY_SET * 32) {
+        _invalidateFree();
+    }
+}
+
+bool SDFSImpl::mountPack(const char *mountPoint, const char *packPath, uint32_t capacity, uint32_t maxEntries)
+{
+    if (!_mounted || !mountPoint || !mountPoint[0] || !packPath) {
+        return false;
+    }
+    const char *key;
+    if (_findPack(mountPoint, &key)) {
+        DEBUGV("SDFSImpl::mountPack() `%s` already mounted\n", mountPoint);
+        return false;
+    }
+    auto pack = std::make_shared<SDFSPack>(this, mountPoint);
+    if (!pack->begin(packPath, capacity, maxEntries)) {
+        return false;
+    }
+    _packs.push_back(pack);
+    return true;
+}
+
+bool SDFSImpl::unmountPack(const char *mountPoint)
+{
+    for (auto it = _packs.begin(); it != _packs.end(); ++it) {
+        const char *key = (*it)->match(mountPoint);
+        if (key && !key[0]) {
+            (*it)->close();
+            _packs.erase(it);
+            return true;
+        }
+    }
+    return false;
+}
+
+std::shared_ptr<SDFSPack> SDFSImpl::_findPack(const char *path, const char **key)
+{
+    for (auto &p : _packs) {
+        if ((*key = p->match(path)) != nullptr) {
+            return p;
+        }
+    }
+    return std::shared_ptr<SDFSPack>();
+}
+
+bool SDFSImpl::indexDir(const char *path)
+{
+    if (!_writable("indexDir")) {
+        return false;
+    }
+    char probe[260];
+    // Anything directly inside path maps back to its index
+    snprintf(probe, sizeof(probe), "%s/x", path);
+    for (auto &idx : _dirIndexes) {
+        if (idx->match(probe)) {
+            return _mounted ? (idx->valid() || idx->begin()) : true;
+        }
+    }
+    auto idx = std::make_shared<SDFSDirIndex>(this, path);
+    if (_mounted && !idx->begin()) {
+        return false;
+    }
+    _dirIndexes.push_back(idx);
+    return true;
+}
+
+bool SDFSImpl::unindexDir(const char *path)
+{
+    char probe[260];
+    snprintf(probe, sizeof(probe), "%s/x", path);
+    for (auto it = _dirIndexes.begin(); it != _dirIndexes.end(); ++it) {
+        if ((*it)->match(probe)) {
+            (*it)->close();
+            _dirIndexes.erase(it);
+            return true;
+        }
+    }
+    return false;
+}
+
+std::shared_ptr<SDFSDirIndex> SDFSImpl::_findIndex(const char *path, const char **leaf)
+{
+    for (auto &idx : _dirIndexes) {
+        if (idx->valid() && ((*leaf = idx->match(path)) != nullptr)) {
+            return idx;
+        }
+    }
+    return std::shared_ptr<SDFSDirIndex>();
+}
+
+// All SDFS opens of real files come through here, so that indexed
+// directories are searched by hash and kept up to date on creation
+::File SDFSImpl::_open(const char *path, oflag_t flags)
+{
+    ::File fd;
+    const char *leaf;
+    auto idx = _findIndex(path, &leaf);
+    int found = idx ? idx->find(leaf, &fd, flags & ~O_CREAT) : -1;
+    if ((found == 1) || ((found == 0) && !(flags & O_CREAT))) {
+        return fd;
+    }
+    if (idx && (flags & O_CREAT)) {
+        idx->touch();
+    }
+    fd = _fs.open(path, flags);
+    if (fd && (flags & O_CREAT)) {
+        _trackCreate(fd);
+        if (found == 0) {
+            idx->add(leaf, fd.dirIndex());
+        }
+    }
+    return fd;
+}
+
+bool SDFSImpl::exists(const char* path)
+{
+    if (!_mounted) {
+        return false;
+    }
+    const char *key;
+    auto pack = _findPack(path, &key);
+    if (pack) {
+        return pack->exists(key);
+    }
+    ::File fd;
+    auto idx = _findIndex(path, &key);
+    int found = idx ? idx->find(key, &fd, O_RDONLY) : -1;
+    return (found < 0) ? _fs.exists(path) : (found == 1);
+}
+
+bool SDFSImpl::rename(const char* pathFrom, const char* pathTo)
+{
+    if (!_mounted || !_writable("rename")) {
+        return false;
+    }
+    const char *keyFrom, *keyTo;
+    auto packFrom = _findPack(pathFrom, &keyFrom);
+    auto packTo = _findPack(pathTo, &keyTo);
+    if (packFrom || packTo) {
+        // Blobs can only be renamed within their own pack
+        return (packFrom == packTo) && packFrom->rename(keyFrom, keyTo);
+    }
+    if (!_renameEntry(pathFrom, pathTo)) {
+        return false;
+    }
+    // A checksum sidecar moves with its file, replacing one of ours that
+    // can only be left over from a file that's gone.  Files that never
+    // had one cost a single lookup.
+    char sumFrom[260], sumTo[260];
+    if (_isSidecar(pathFrom, sumFrom) && _sidecarPath(pathTo, sumTo)) {
+        if (_isSidecar(pathTo, sumTo)) {
+            _removeEntry(sumTo);
+        }
+        _renameEntry(sumFrom, sumTo);
+    }
+    return true;
+}
+
+bool SDFSImpl::_renameEntry(const char *pathFrom, const char *pathTo)
+{
+    const char *keyFrom, *keyTo;
+    _invalidateFree(); // Target directory may have grown
+    auto idxFrom = _findIndex(pathFrom, &keyFrom);
+    auto idxTo = _findIndex(pathTo, &keyTo);
+    if (!idxFrom && !idxTo) {
+        return _fs.rename(pathFrom, pathTo);
+    }
+    // Rename the open entry so we learn where it ends up
+    ::File fd = _open(pathFrom, O_RDONLY);
+    if (!fd) {
+        return false;
+    }
+    uint16_t oldIndex = fd.dirIndex();
+    if (idxFrom) {
+        idxFrom->touch();
+    }
+    if (idxTo) {
+        idxTo->touch();
+    }
+    if (!(idxTo ? fd.rename(idxTo->dir(), keyTo) : fd.rename(pathTo))) {
+        return false;
+    }
+    if (idxFrom) {
+        idxFrom->erase(keyFrom, oldIndex);
+    }
+    if (idxTo) {
+        idxTo->add(keyTo, fd.dirIndex());
+    }
+    return true;
+}
+
+bool SDFSImpl::_sidecarPath(const char *path, char (&sumPath)[260])
+{
+    int n = snprintf(sumPath, sizeof(sumPath), "%s" SDFS_CHECKSUM_SUFFIX, path);
+    return (n > 0) && ((size_t)n < sizeof(sumPath));
+}
+
+// Whether path has a checksum sidecar, going by its header, so a user's
+// own file that just happens to be called path.crc is never touched
+bool SDFSImpl::_isSidecar(const char *path, char (&sumPath)[260])
+{
+    if (!_sidecarPath(path, sumPath)) {
+        return false;
+    }
+    ::File fd = _open(sumPath, O_RDONLY);
+    SDFSChecksumHeader hdr;
+    bool ret = fd && fd.isFile() && (fd.read(&hdr, sizeof(hdr)) == (int)sizeof(hdr)) &&
+               (hdr.magic == SDFSChecksumFileImpl::MAGIC);
+    fd.close();
+    return ret;
+}
+
+bool SDFSImpl::checksumReport(const fs::FileImplPtr &file, SDFSChecksumReport *report)
+{
+    for (auto &w : _checksumFiles) {
+        auto f = w.lock();
+        if (f && (f.get() == file.get())) {
+            *report = f->report();
+            return true;
+        }
+    }
+    return false;
+}
+
+bool SDFSImpl::remove(const char* path)
+{
+    if (!_mounted || !_writable("remove")) {
+        return false;
+    }
+    const char *key;
+    auto pack = _findPack(path, &key);
+    if (pack) {
+        return pack->remove(key);
+    }
+    if (!_removeEntry(path)) {
+        return false;
+    }
+    // Don't leave a checksum sidecar behind to fail a new file of the
+    // same name
+    char sumPath[260];
+    if (_isSidecar(path, sumPath)) {
+        _removeEntry(sumPath);
+    }
+    return true;
+}
+
+bool SDFSImpl::_removeEntry(const char *path)
+{
+    const char *key;
+    // Open it ourselves so we know how many clusters are being released
+    ::File fd = _open(path, O_WRITE);
+    if (!fd) {
+        return false;
+    }
+    uint32_t size = fd.fileSize();
+    uint16_t dirIndex = fd.dirIndex();
+    auto idx = _findIndex(path, &key);
+    if (idx) {
+        idx->touch();
+    }
+    if (!fd.remove()) {
+        return false;
+    }
+    if (idx) {
+        idx->erase(key, dirIndex);
+    }
+    _trackAlloc(size, 0);
+    return true;
+}
+
+bool SDFSImpl::mkdir(const char* path)
+{
+    if (!_mounted || !_writable("mkdir")) {
+        return false;
+    }
+    const char *leaf;
+    if (_findPack(path, &leaf)) {
+        DEBUGV("SDFSImpl::mkdir() packs have no directories: %s\n", path);
+        return false;
+    }
+    _invalidateFree();
+    return _mkdirs(path, false);
+}
+
+// Makes one directory whose parent exists, keeping the parent's index up
+// to date if it has one
+bool SDFSImpl::_mkdirOne(const char *path)
+{
+    const char *leaf;
+    auto idx = _findIndex(path, &leaf);
+    if (idx) {
+        idx->touch();
+    }
+    if (!_fs.mkdir(path, false)) {
+        return false;
+    }
+    if (idx) {
+        ::File fd = _fs.open(path, O_RDONLY);
+        if (fd) {
+            idx->add(leaf, fd.dirIndex());
+        }
+    }
+    return true;
+}
+
+// Makes path and any missing parents one level at a time, rather than
+// letting SdFat make the parents, so each new entry goes through its
+// directory's index.  An existing path is only OK with existOk.
+bool SDFSImpl::_mkdirs(const char *path, bool existOk)
+{
+    char buf[260];
+    size_t len = strlen(path);
+    while (len && (path[len - 1] == '/')) {
+        len--;
+    }
+    if (!len || (len >= sizeof(buf))) {
+        return false;
+    }
+    memcpy(buf, path, len);
+    buf[len] = 0;
+    for (char *p = buf + 1; ; p++) {
+        if (*p && ((*p != '/') || (p[-1] == '/'))) {
+            continue;
+        }
+        char c = *p;
+        *p = 0;
+        bool last = !c;
+        if ((!last || existOk) && exists(buf)) {
+            // Already there
+        } else if (!_mkdirOne(buf)) {
+            return false;
+        }
+        if (last) {
+            return true;
+        }
+        *p = c;
+    }
+}
+
+bool SDFSImpl::rmdir(const char* path)
+{
+    if (!_mounted || !_writable("rmdir")) {
+        return false;
+    }
+    const char *leaf;
+    if (_findPack(path, &leaf)) {
+        DEBUGV("SDFSImpl::rmdir() packs have no directories: %s\n", path);
+        return false;
+    }
+    _invalidateFree();
+    auto idx = _findIndex(path, &leaf);
+    if (!idx) {
+        return _fs.rmdir(path);
+    }
+    ::File fd = _open(path, O_RDONLY);
+    if (!fd) {
+        return false;
+    }
+    uint16_t dirIndex = fd.dirIndex();
+    idx->touch();
+    if (!fd.rmdir()) {
+        return false;
+    }
+    idx->erase(leaf, dirIndex);
+    return true;
+}
+
+// Transfer buffers for copy()/sendTo()/receiveFrom().  Whole sectors at
+// sector aligned file offsets go straight between the card and the buffer,
+// as one multi-sector command, instead of through SdFat's sector cache.
+class SDFSPumpBuffers
+{
+public:
+    enum { MAX_LEN = 4096 };
+
+    SDFSPumpBuffers(int count) : _mem(nullptr), _len(MAX_LEN)
+    {
+        // Settle for less when the heap is tight
+        while ((_len >= 512) && !(_mem = (uint8_t *)malloc(_len * count))) {
+            _len /= 2;
+        }
+    }
+
+    ~SDFSPumpBuffers()
+    {
+        free(_mem);
+    }
+
+    uint8_t *operator[](int i)
+    {
+        return _mem + i * _len;
+    }
+
+    bool valid() const
+    {
+        return _mem != nullptr;
+    }
+
+    size_t len() const
+    {
+        return _len;
+    }
+
+protected:
+    uint8_t *_mem;
+    size_t   _len;
+};
+
+// Opens path for writing, creating it or emptying what's there
+::File SDFSImpl::_replace(const char *path)
+{
+    const char *key;
+    if (_findPack(path, &key)) {
+        DEBUGV("SDFSImpl::_replace() files in packs aren't supported: %s\n", path);
+        return ::File();
+    }
+    ::File fd = _open(path, O_RDWR | O_CREAT);
+    if (fd) {
+        uint32_t oldSize = fd.fileSize();
+        fd.truncate(0);
+        _trackAlloc(oldSize, 0);
+    }
+    return fd;
+}
+
+bool SDFSImpl::copy(const char *pathFrom, const char *pathTo)
+{
+    if (!_mounted || !_writable("copy") || !strcmp(pathFrom, pathTo)) {
+        return false;
+    }
+    const char *key;
+    if (_findPack(pathFrom, &key)) {
+        DEBUGV("SDFSImpl::copy() files in packs aren't supported: %s\n", pathFrom);
+        return false;
+    }
+    ::File src = _open(pathFrom, O_RDONLY);
+    if (!src || src.isDirectory()) {
+        return false;
+    }
+    // FAT names are case insensitive and paths may be relative, so the
+    // same file can hide behind two different names, and _replace() would
+    // empty it before it was read.  Files with data are told apart by their
+    // first cluster; an empty one has nothing to lose.
+    if (src.firstCluster()) {
+        ::File probe = _open(pathTo, O_RDONLY);
+        if (probe && (probe.firstCluster() == src.firstCluster())) {
+            DEBUGV("SDFSImpl::copy() %s and %s are the same file\n", pathFrom, pathTo);
+            return false;
+        }
+    }
+    SDFSPumpBuffers buf(1);
+    if (!buf.valid()) {
+        return false;
+    }
+    ::File dst = _replace(pathTo);
+    if (!dst) {
+        return false;
+    }
+    SDFSDataIO io(this);
+    uint32_t size = src.fileSize();
+    // One contiguous run for the lot, so the data goes out in long
+    // multi-sector writes and the FAT is written once instead of per cluster
+    if (size && dst.preAllocate(size)) {
+        _trackAlloc(0, size);
+    } else if (size) {
+        DEBUGV("SDFSImpl::copy() no contiguous space for %u bytes\n", size);
+        _invalidateFree();
+    }
+    uint32_t done = 0;
+    while (done < size) {
+        size_t want = std::min((uint32_t)buf.len(), size - done);
+        if ((src.read(buf[0], want) != (int)want) || (dst.write(buf[0], want) != want)) {
+            DEBUGV("SDFSImpl::copy() failed at %u of %u\n", done, size);
+            break;
+        }
+        done += want;
+    }
+    if (done < size) {
+        // The preallocated rest of the file holds whatever was on the card
+        dst.truncate(done);
+        _invalidateFree();
+    }
+    return dst.close() && (done == size);
+}
+
+size_t SDFSImpl::sendTo(const char *path, Print &dst)
+{
+    if (!_mounted) {
+        return 0;
+    }
+    const char *key;
+    if (_findPack(path, &key)) {
+        DEBUGV("SDFSImpl::sendTo() files in packs aren't supported: %s\n", path);
+        return 0;
+    }
+    ::File src = _open(path, O_RDONLY);
+    SDFSPumpBuffers buf(2);
+    if (!src || src.isDirectory() || !buf.valid()) {
+        return 0;
+    }
+    SDFSDataIO io(this);
+    size_t total = 0;
+    size_t filled[2] = { 0, 0 };
+    size_t sent = 0;
+    int cur = 0;
+    bool eof = false;
+    int n = src.read(buf[cur], buf.len());
+    filled[cur] = (n > 0) ? n : 0;
+    eof = filled[cur] < buf.len();
+    while (filled[cur]) {
+        int other = cur ^ 1;
+        // Hand over what the stream can take without blocking, then read
+        // the next chunk while it goes out
+        int room = dst.availableForWrite();
+        if (room > 0) {
+            sent += dst.write(buf[cur] + sent, std::min((size_t)room, filled[cur] - sent));
+        }
+        if (!eof && !filled[other]) {
+            n = src.read(buf[other], buf.len());
+            filled[other] = (n > 0) ? n : 0;
+            eof = filled[other] < buf.len();
+        } else if (sent < filled[cur]) {
+            size_t wrote = dst.write(buf[cur] + sent, filled[cur] - sent);
+            if (!wrote) {
+                DEBUGV("SDFSImpl::sendTo() stream stopped taking data\n");
+                break;
+            }
+            sent += wrote;
+        }
+        if (sent == filled[cur]) {
+            total += sent;
+            filled[cur] = 0;
+            sent = 0;
+            cur = other;
+        }
+    }
+    return total + sent;
+}
+
+size_t SDFSImpl::receiveFrom(Stream &src, const char *path, size_t len)
+{
+    if (!_mounted || !_writable("receiveFrom")) {
+        return 0;
+    }
+    SDFSPumpBuffers buf(1);
+    if (!buf.valid()) {
+        return 0;
+    }
+    ::File dst = _replace(path);
+    if (!dst) {
+        return 0;
+    }
+    SDFSDataIO io(this);
+    bool allocated = (len != SIZE_MAX) && len && dst.preAllocate(len);
+    if (allocated) {
+        _trackAlloc(0, len);
+    }
+    // The stream keeps filling its own receive buffer while we write, so a
+    // second buffer here wouldn't buy anything
+    size_t total = 0;
+    while (total < len) {
+        size_t want = std::min(buf.len(), len - total);
+        size_t got = src.readBytes(buf[0], want);
+        if (got && (dst.write(buf[0], got) != got)) {
+            DEBUGV("SDFSImpl::receiveFrom() write failed at %u\n", total);
+            break;
+        }
+        total += got;
+        if (got < want) {
+            break; // Timed out
+        }
+    }
+    if (allocated && (total < len)) {
+        // Give back what wasn't used
+        dst.truncate(total);
+        _trackAlloc(len, total);
+    } else if (!allocated) {
+        _trackAlloc(0, total);
+    }
+    dst.close();
+    return total;
+}
+
+// Zeroes the contiguous clusters of a freshly preallocated file with
+// erase commands, so nothing is written.  On FAT preAllocate() has already
+// given the file its new size, in the handle and, once synced, in its
+// directory entry.  exFAT's doesn't move the valid length, so that's left
+// to _extendZeros().
+bool SDFSImpl::_extendErased(::File &fd)
+{
+    uint32_t first, last;
+    if (_fs.fatType() > 32) {
+        return false;
+    }
+    if (_eraseZero < 0) {
+        // Erased sectors read back as all zeros or all ones depending on
+        // the card, which says which in the SCR's DATA_STAT_AFTER_ERASE
+        // bit.  Ones are no use to us.
+        scr_t scr;
+        _eraseZero = (_fs.card()->readSCR(&scr) && !scr.dataAfterErase()) ? 1 : 0;
+        DEBUGV("SDFSImpl::_extendErased() erased sectors read as %s\n", _eraseZero ? "zeros" : "ones or unknown");
+    }
+    if (!_eraseZero || !fd.contiguousRange(&first, &last) || !fd.sync()) {
+        return false;
+    }
+    uint8_t sector[512];
+    if (!_eraseSectors(first, last) ||
+        !_readSectors(first, sector, 1)) {
+        DEBUGV("SDFSImpl::_extendErased() erase of %u..%u failed\n", first, last);
+        return false;
+    }
+    // Cheap check that the erase really happened
+    for (size_t i = 0; i < sizeof(sector); i++) {
+        if (sector[i]) {
+            DEBUGV("SDFSImpl::_extendErased() erased sectors aren't zero\n");
+            return false;
+        }
+    }
+    return true;
+}
+
+// Writes zeros from from up to size.  After preAllocate() the file may
+// already be size long on FAT, with whatever the card held in it.
+bool SDFSImpl::_extendZeros(::File &fd, uint32_t from, uint32_t size)
+{
+    SDFSPumpBuffers buf(1);
+    if (!buf.valid() || !fd.seekSet(from)) {
+        return false;
+    }
+    SDFSDataIO io(this);
+    memset(buf[0], 0, buf.len());
+    for (uint32_t pos = from; pos < size; ) {
+        // Sector align first, so the rest goes out as multi-sector writes
+        size_t n = std::min((uint32_t)(buf.len() - pos % 512), size - pos);
+        if (fd.write(buf[0], n) != n) {
+            return false;
+        }
+        pos += n;
+    }
+    return true;
+}
+
+// Grows fd to size, filled with zeros
+bool SDFSImpl::_extend(::File &fd, uint32_t size)
+{
+    uint32_t pos = fd.curPosition();
+    uint32_t oldSize = fd.fileSize();
+    bool ok = false;
+    if (!oldSize && !fd.firstCluster() && fd.preAllocate(size)) {
+        // Nothing allocated yet, so it can all be one contiguous run
+        ok = _extendErased(fd);
+    }
+    if (!ok) {
+        // Zero everything past the old end, preallocated or not, so stale
+        // card contents never show through
+        ok = _extendZeros(fd, oldSize, size);
+    }
+    if (!ok) {
+        _invalidateFree();
+        return false;
+    }
+    return fd.seekSet(pos);
+}
+
+// SdFat follows a file's cluster chain through the FAT on every seek
+// backwards or far ahead, unless it knows the file is contiguous.  A
+// read-only handle on a contiguous file reads by sector number instead,
+// so seeks are arithmetic and reads never touch the FAT.  SdFat only
+// remembers contiguity for files it allocated that way in this session
+// (preAllocate(), which copy(), receiveFrom() and growing truncate() use),
+// and contiguousRange() answers those straight away.  For anything else,
+// such as a recording read back after a power cycle, it walks the chain
+// once per handle, on the first read: one FAT sector read per 128
+// clusters (256 on FAT16) of file.  Small files aren't worth the walk or
+// the sector buffer.
+bool SDFSFileImpl::_directBegin()
+{
+    _direct = 0;
+    uint32_t last;
+    if (_fd->isWritable() || !_fd->isFile() ||
+        (_fd->fileSize() <= 4UL * _fs->_fs.sectorsPerCluster() * 512) ||
+        !_fd->contiguousRange(&_firstSector, &last)) {
+        return false;
+    }
+    _buf.reset(new (std::nothrow) uint8_t[512]);
+    // Anything another handle left in SdFat's cache must be on the card
+    if (!_firstSector || !_buf || !_fs->_fs.cacheClear()) {
+        _buf.reset();
+        return false;
+    }
+    DEBUGV("SDFSFileImpl::_directBegin() %s at sector %u\n", _name.get(), _firstSector);
+    _pos = _fd->curPosition();
+    _bufSector = UINT32_MAX;
+    _direct = 1;
+    return true;
+}
+
+size_t SDFSFileImpl::_directRead(uint8_t *buf, size_t size)
+{
+    uint32_t fileSize = _fd->fileSize();
+    if (_pos >= fileSize) {
+        return 0;
+    }
+    size = std::min(size, (size_t)(fileSize - _pos));
+    size_t done = 0;
+    while (done < size) {
+        uint32_t sector = _firstSector + _pos / 512;
+        uint32_t off = _pos % 512;
+        size_t n;
+        if (!off && (size - done >= 512)) {
+            // Whole sectors go straight into the caller's buffer
+            n = (size - done) / 512;
+            if (!_fs->_readSectors(sector, buf + done, n)) {
+                break;
+            }
+            n *= 512;
+        } else {
+            if ((sector != _bufSector) && !_fs->_readSectors(sector, _buf.get(), 1)) {
+                break;
+            }
+            _bufSector = sector;
+            n = std::min((size_t)(512 - off), size - done);
+            memcpy(buf + done, _buf.get() + off, n);
+        }
+        done += n;
+        _pos += n;
+    }
+    return done;
+}
 
 fs::FileImplPtr SDFSImpl::open(const char* path, OpenMode openMode, AccessMode accessMode)
 {
@@ -49,8 +1061,68 @@ fs::FileImplPtr SDFSImpl::open(const char* path, OpenMode openMode, AccessMode a
         DEBUGV("SDFSImpl::open() called with invalid filename\n");
         return fs::FileImplPtr();
     }
-    int flags = _getFlags(openMode, accessMode);
-    if ((openMode && OM_CREATE) && strchr(path, '/')) {
+    if (_mutates(openMode, accessMode) && !_writable("open")) {
+        return fs::FileImplPtr();
+    }
+    const char *key;
+    auto pack = _findPack(path, &key);
+    if (pack) {
+        if (openMode & (OM_COMPRESS | OM_CHECKSUM)) {
+            DEBUGV("SDFSImpl::open() no compressed or checksummed files in packs: %s\n", path);
+            return fs::FileImplPtr();
+        }
+        return pack->open(key, openMode, accessMode);
+    }
+    if (openMode & OM_COMPRESS) {
+        // The wrapper appends itself, and writers need to read back the
+        // old trailer to carry on from it
+        OpenMode innerMode = OpenMode(openMode & ~(OM_COMPRESS | OM_APPEND));
+        AccessMode innerAccess = (accessMode & AM_WRITE) ? AM_RW : accessMode;
+        auto inner = open(path, innerMode, innerAccess);
+        if (!inner) {
+            return fs::FileImplPtr();
+        }
+        auto ret = SDFSCompressFileImpl::create(inner, accessMode);
+        if (!ret) {
+            DEBUGV("SDFSImpl::open() not a usable compressed file: %s\n", path);
+            return fs::FileImplPtr();
+        }
+        _trackHandle(_openFiles, ret);
+        return ret;
+    }
+    if (openMode & OM_CHECKSUM) {
+        // Writers read back the start of a block they didn't write whole
+        bool writing = accessMode & AM_WRITE;
+        auto inner = open(path, OpenMode(openMode & ~OM_CHECKSUM), writing ? AM_RW : accessMode);
+        if (!inner) {
+            return fs::FileImplPtr();
+        }
+        char sumPath[260];
+        if (!_sidecarPath(path, sumPath)) {
+            return fs::FileImplPtr();
+        }
+        if (writing) {
+            // Hidden, so listings here and on other hosts can skip it
+            // without looking for the file it belongs to
+            ::File fd = _open(sumPath, O_RDWR | O_CREAT);
+            if (!fd || (!fd.isHidden() && !fd.attrib(fd.attrib() | FS_ATTRIB_HIDDEN))) {
+                return fs::FileImplPtr();
+            }
+            fd.close();
+        }
+        auto sums = writing ? open(sumPath, OpenMode(OM_CREATE | (openMode & OM_TRUNCATE)), AM_RW)
+                            : open(sumPath, OM_DEFAULT, AM_READ);
+        auto ret = SDFSChecksumFileImpl::create(inner, sums, openMode, accessMode);
+        if (!ret) {
+            return fs::FileImplPtr();
+        }
+        _trackHandle(_openFiles, ret);
+        _trackHandle(_checksumFiles, std::static_pointer_cast<SDFSChecksumFileImpl>(ret));
+        return ret;
+    }
+    int flags = _getFlags(openMode, accessMode) & ~O_TRUNC;
+    const char *leaf;
+    if ((openMode & OM_CREATE) && strchr(path, '/') && !_findIndex(path, &leaf)) {
         DEBUGV("SDFSImpl::open() with OM_CREATE\n");
         // For file creation, silently make subdirs as needed.  If any fail,
         // it will be caught by the real file open later on
@@ -60,21 +1132,32 @@ fs::FileImplPtr SDFSImpl::open(const char* path, OpenMode openMode, AccessMode a
             char *ptr = strrchr(pathStr, '/');
             if (ptr && ptr != pathStr) { // Don't try to make root dir!
                 *ptr = 0;
-                _fs.mkdir(pathStr, true);
+                if (!exists(pathStr)) {
+                    _invalidateFree(); // New directories take clusters
+                    _mkdirs(pathStr, true);
+                }
             }
         }
         free(pathStr);
     }
     DEBUGV("SDFSImpl::open() path=[%s] flags=%d\n", path, flags);
-    ::File fd = _fs.open(path, flags);
+    ::File fd = _open(path, flags);
     if (!fd) {
         DEBUGV("SDFSImpl::open() fail: fd=%p path=`%s` flags=%d openMode=%d accessMode=%d error=%d",
                &fd, path, flags, openMode, accessMode, _fs.sdErrorCode());
         return fs::FileImplPtr();
     }
     DEBUGV("SDFSImpl::open() ok\n");
+    if (openMode & OM_TRUNCATE) {
+        // Truncate here rather than via O_TRUNC to see what was released
+        uint32_t oldSize = fd.fileSize();
+        fd.truncate(0);
+        _trackAlloc(oldSize, 0);
+    }
     auto sharedFd = std::make_shared<::File>(fd);
-    return std::make_shared<SDFSFileImpl>(this, sharedFd, path);
+    auto ret = std::make_shared<SDFSFileImpl>(this, sharedFd, path);
+    _trackHandle(_openFiles, ret);
+    return ret;
 }
 
 fs::FileImplPtr SDFSImpl::open(sdfs::SDFSDirImpl * dir, uint32_t dirIndex, OpenMode openMode, AccessMode accessMode)
@@ -83,7 +1166,10 @@ fs::FileImplPtr SDFSImpl::open(sdfs::SDFSDirImpl * dir, uint32_t dirIndex, OpenM
         DEBUGV("SDFSImpl::open() called on unmounted FS\n");
         return fs::FileImplPtr();
     }
-    int flags = _getFlags(openMode, accessMode);
+    if (_mutates(openMode, accessMode) && !_writable("open")) {
+        return fs::FileImplPtr();
+    }
+    int flags = _getFlags(openMode, accessMode) & ~O_TRUNC;
     ::File fd;
     fd.open(dir->_dir.get(), dirIndex, flags);
     if (!fd) {
@@ -91,8 +1177,15 @@ fs::FileImplPtr SDFSImpl::open(sdfs::SDFSDirImpl * dir, uint32_t dirIndex, OpenM
                &fd, dirIndex, flags, openMode, accessMode, _fs.sdErrorCode());
         return fs::FileImplPtr();
     }
+    if (openMode & OM_TRUNCATE) {
+        uint32_t oldSize = fd.fileSize();
+        fd.truncate(0);
+        _trackAlloc(oldSize, 0);
+    }
     auto sharedFd = std::make_shared<::File>(fd);
-    return std::make_shared<SDFSFileImpl>(this, sharedFd, dir->fileName());
+    auto ret = std::make_shared<SDFSFileImpl>(this, sharedFd, dir->fileName());
+    _trackHandle(_openFiles, ret);
+    return ret;
 }
 
 fs::DirImplPtr SDFSImpl::openDir(const char* path)
@@ -101,6 +1194,11 @@ fs::DirImplPtr SDFSImpl::openDir(const char* path)
     if (!_mounted) {
         return fs::DirImplPtr();
     }
+    const char *key;
+    auto pack = _findPack(path, &key);
+    if (pack) {
+        return key[0] ? fs::DirImplPtr() : pack->openDir();
+    }
     char *pathStr = strdup(path); // Allow edits on our scratch copy
     if (!pathStr) {
         // OOM
@@ -160,12 +1258,13 @@ fs::DirImplPtr SDFSImpl::openDir(const char* path)
     DEBUGV("SDFSImpl::openDir ok: path=`%s` filter='%s'\n", path, filter);
     auto sharedDir = std::make_shared<::File>(dirFile);
     auto ret = std::make_shared<SDFSDirImpl>(filter, this, sharedDir, pathStr);
+    _trackHandle(_openDirs, ret);
     free(pathStr);
     return ret;
 }
 
 bool SDFSImpl::format() {
-    if (_mounted) {
+    if (_mounted || !_writable("format")) {
         return false;
     }
     SDFSFormatter formatter;
@@ -28,6 +28,7 @@
  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
  */
 #include <limits>
+#include <vector>
 #include <assert.h>
 #include "FS.h"
 #include "FSImpl.h"
@@ -38,13 +39,30 @@
 #define DEBUG
 #include <esp_debug.h>
 #include <TimeLib.h>
+#include "SDFSBlockDevice.h"
+#include "SDFSTime.h"
 
 //using namespace fs;
 
 namespace sdfs {
 
+#define SDFS_DIRINDEX_NAME ".sdfsidx"
+#define SDFS_CHECKSUM_SUFFIX ".crc"
+
+// SDFS-only OpenMode bits.  FS::open() only takes mode strings, so these
+// are passed to SDFSImpl::open() directly, e.g.
+//   impl->open("/log.csv", OpenMode(OM_CREATE | OM_APPEND | OM_COMPRESS), AM_WRITE)
+enum SDFSOpenMode {
+    OM_COMPRESS = 0x100,  // Block compressed, see SDFSCompress.h
+    OM_CHECKSUM = 0x200,  // CRC32C per block, see SDFSChecksum.h
+};
+
 class SDFSFileImpl;
 class SDFSDirImpl;
+class SDFSPack;
+class SDFSDirIndex;
+class SDFSChecksumFileImpl;
+struct SDFSChecksumReport;
 
 class SDFSConfig : public fs::FSConfig
 {
@@ -95,35 +113,80 @@ public:
         _part = part;
         return *this;
     }
+    // Remember volume geometry and free space across end()/begin() so a
+    // remount after powering the card down can skip the FAT scan.  FAT32
+    // only; the volume's FSInfo sector tells whether another host wrote it.
+    SDFSConfig setWarmRemount(bool val = true) {
+        _warmRemount = val;
+        return *this;
+    }
+    // Hold up to sectors writes for at most maxDelayMs so reads can go
+    // first and adjacent writes merge, see SDFSScheduler.h.  Needs SdFat's
+    // virtual block device interface; ignored without it.
+    SDFSConfig setIOScheduler(uint16_t sectors, uint16_t maxDelayMs = 50) {
+        _schedSectors = sectors;
+        _schedDelay = maxDelayMs;
+        return *this;
+    }
+    // Mount without ever writing to the card.  Anything that would modify
+    // the volume fails up front, and up to cacheSectors of FAT and
+    // directory sectors are cached below SdFat (needs the same virtual
+    // block device interface as the scheduler).
+    SDFSConfig setReadOnly(bool val = true, uint16_t cacheSectors = 32) {
+        _readOnly = val;
+        _readCache = cacheSectors;
+        return *this;
+    }
     
     // Inherit _type and _autoFormat
     uint8_t     _csPin;
     uint8_t     _part;
     uint32_t _maxSpeed;
     uint8_t _mode = SHARED_SPI;
+    bool _warmRemount = false;
+    uint16_t _schedSectors = 0;
+    uint16_t _schedDelay = 50;
+    bool _readOnly = false;
+    uint16_t _readCache = 0;
     SdSpiConfig  *  _spiConfig = NULL;
     SdioConfig  * _sdioConfig = NULL;
 };
 
+// Volume state saved by end() for a warm begin().  Only trusted again if
+// the geometry and the signature of the on-card metadata still match.
+struct SDFSWarmState
+{
+    bool     valid;
+    uint8_t  fatType;
+    uint8_t  sectorsPerCluster;
+    uint32_t clusterCount;
+    uint32_t fatStartSector;
+    uint32_t dataStartSector;
+    uint32_t fsInfoSector;
+    uint32_t signature;
+    int32_t  freeClusters;
+};
+
 class SDFSImpl : public fs::FSImpl
 {
 public:
-    SDFSImpl() : _mounted(false)
+    SDFSImpl() : _mounted(false), _freeClusters(-1), _eraseZero(-1), _ioContext(IO_DIR)
+#if SDFS_BLOCK_DEVICE
+        , _io(&_ioStats, &_ioContext)
+#endif
     {
+        memset(&_warm, 0, sizeof(_warm));
+        resetIOStats();
     }
 
     fs::FileImplPtr open(const char* path, OpenMode openMode, AccessMode accessMode) override;
     fs::FileImplPtr SDFSImpl::open(SDFSDirImpl *  dir, uint32_t dirIndex, OpenMode openMode, AccessMode accessMode);
 
-    bool exists(const char* path) override {
-        return _mounted ? _fs.exists(path) : false;
-    }
+    bool exists(const char* path) override;
 
     fs::DirImplPtr openDir(const char* path) override;
 
-    bool rename(const char* pathFrom, const char* pathTo) override {
-        return _mounted ? _fs.rename(pathFrom, pathTo) : false;
-    }
+    bool rename(const char* pathFrom, const char* pathTo) override;
 
     bool info64(fs::FSInfo64& info) override {
         if (!_mounted) {
@@ -135,7 +198,7 @@ public:
         info.pageSize = 0; // TODO ?
         info.maxPathLength = 255; // TODO ?
         info.totalBytes =_fs.clusterCount() * _fs.sectorsPerCluster() *512LL;
-        info.usedBytes = info.totalBytes - (_fs.freeClusterCount() * _fs.sectorsPerCluster() * 512LL);
+        info.usedBytes = info.totalBytes - (freeClusters() * _fs.sectorsPerCluster() * 512LL);
         return true;
     }
 
@@ -159,17 +222,11 @@ public:
         return true;
     }
 
-    bool remove(const char* path) override {
-        return _mounted ? _fs.remove(path) : false;
-    }
+    bool remove(const char* path) override;
 
-    bool mkdir(const char* path) override {
-        return _mounted ? _fs.mkdir(path) : false;
-    }
+    bool mkdir(const char* path) override;
 
-    bool rmdir(const char* path) override {
-        return _mounted ?_fs.rmdir(path) : false;
-    }
+    bool rmdir(const char* path) override;
 
     bool setConfig(const fs::FSConfig &cfg) override
     {
@@ -181,34 +238,70 @@ public:
         return true;
     }
 
-    bool begin() override {
-        if (_mounted) {
-            end();
-        }
-        if(_cfg._sdioConfig) {
-            _mounted = _fs.begin(*_cfg._sdioConfig);
-            if (!_mounted && _cfg._autoFormat) {
-                format();
-                _mounted = _fs.begin(*_cfg._sdioConfig);
-            }
-        } else if (_cfg._spiConfig) {
-            _mounted = _fs.begin(*_cfg._spiConfig);
-            if (!_mounted && _cfg._autoFormat) {
-                format();
-                _mounted = _fs.begin(*_cfg._spiConfig);
-            }
-        }
-	FsDateTime::setCallback(dateTimeCB);
-        return _mounted;
-    }
+    bool begin() override;
 
-    void end() override {
-        _mounted = false;
-        // TODO
-    }
+    void end() override;
 
     bool format() override;
 
+    // Serve the packed archive in packPath (see SDFSPack.h) under mountPoint,
+    // so open("/mountPoint/key") reads and writes blobs in it.  capacity and
+    // maxEntries are only used if the pack has to be created.  Packs are
+    // dropped by end() and must be mounted again after begin().  On a
+    // read-only mount the pack must already exist and only serves reads.
+    bool mountPack(const char *mountPoint, const char *packPath, uint32_t capacity = 0, uint32_t maxEntries = 0);
+    bool unmountPack(const char *mountPoint);
+
+    // Keep a hashed name index (see SDFSDirIndex.h) for a large directory so
+    // lookups in it open entries by dirIndex instead of scanning.  Indexed
+    // directories are remembered across end() and reloaded by begin().
+    bool indexDir(const char *path);
+    bool unindexDir(const char *path);
+
+    // Copy a file, or pump one to or from a stream, through multi-sector
+    // buffers that bypass SdFat's sector cache.  copy() allocates the new
+    // file in one contiguous run up front.  sendTo() reads the next chunk
+    // from the card while the stream is still sending the last one.
+    // receiveFrom() replaces path with up to len bytes from src, stopping
+    // early when src times out.  Files in packs aren't supported.
+    bool copy(const char *pathFrom, const char *pathTo);
+    size_t sendTo(const char *path, Print &dst);
+    size_t receiveFrom(Stream &src, const char *path, size_t len = SIZE_MAX);
+
+    // What reads through a handle opened with OM_CHECKSUM (and without
+    // OM_COMPRESS) have verified so far, see SDFSChecksum.h.  False for
+    // any other handle.
+    bool checksumReport(const fs::FileImplPtr &file, SDFSChecksumReport *report);
+
+    // Card level I/O counters since mount or the last reset, see
+    // SDFSBlockDevice.h.  The counters keep running across end()/begin().
+    const SDFSIOStats &ioStats() const {
+        return _ioStats;
+    }
+    void resetIOStats() {
+        memset(&_ioStats, 0, sizeof(_ioStats));
+    }
+
+    // The I/O scheduler, for its stats and trace capture.  nullptr when
+    // SdFat has no virtual block device interface.
+    SDFSScheduler *ioScheduler() {
+#if SDFS_BLOCK_DEVICE
+        return _io.scheduler();
+#else
+        return nullptr;
+#endif
+    }
+
+    // Writes out queued writes that are due.  Call from loop() when idle
+    // so the scheduler's delay bound holds even without other card traffic.
+    bool poll() {
+#if SDFS_BLOCK_DEVICE
+        return !_mounted || _io.scheduler()->poll();
+#else
+        return true;
+#endif
+    }
+
     // The following are not common FS interfaces, but are needed only to
     // support the older SD.h exports
     uint8_t type() {
@@ -233,54 +326,32 @@ public:
         return (clusterSize() * totalClusters());
     }
 
-    // Helper function, takes FAT and makes standard time_t
-    static time_t FatToTimeT(uint16_t d, uint16_t t) {
-        TimeElements te;
-        memset(&te, 0, sizeof(TimeElements));
-        te.Second  = (((int)t) <<  1) & 0x3e;
-        te.Minute  = (((int)t) >>  5) & 0x3f;
-        te.Hour = (((int)t) >> 11) & 0x1f;
-        te.Day = (int)(d & 0x1f);
-        te.Month  = ((int)(d >> 5) & 0x0f) - 1;
-        te.Year = ((int)(d >> 9) & 0x7f) + 10;
-        return makeTime(te);
-    }
-    static time_t FatToTimeT(uint8_t * d, uint8_t * t) {
-        TimeElements te;
-        memset(&te, 0, sizeof(TimeElements));
-        uint16_t dd, td;
-        dd = d[1] << 8 | d[0];
-        td = t[1] << 8 | t[0];
-        te.Second  = (((int)td) <<  1) & 0x3e;
-        te.Minute  = (((int)td) >>  5) & 0x3f;
-        te.Hour = (((int)td) >> 11) & 0x1f;
-        te.Day = (int)(dd & 0x1f);
-        te.Month  = ((int)(dd >> 5) & 0x0f) - 1;
-        te.Year = ((int)(dd >> 9) & 0x7f) + 10;
-        return makeTime(te);
-     }
-
-    // Because SdFat has a single, global setting for this we can only use a
-    // static member of our class to return the time/date.  However, since
-    // this is static, we can't see the time callback variable.  Punt for now,
-    // using time(NULL) as the best we can do.
-    //static void dateTimeCB(uint16_t *dosYear, uint16_t *dosTime) {
-    //    time_t now = time(nullptr);
-    //    *dosYear = ((year(t) - 1980) << 9) | ((month(t) + 1) << 5) | day(t);
-    //    *dosTime = (hour(t) << 11) | (min(t) << 5) | sec(t);
-    //}
-    // Call back for file timestamps.  Only called for file create and sync().
-   static void dateTimeCB(uint16_t* date, uint16_t* time, uint8_t* ms10) {
-      time_t t = now(); 
-      // Return date using FS_DATE macro to format fields.
-      *date = FS_DATE(year(t), month(t), day(t));
-
-      // Return time using FS_TIME macro to format fields.
-      *time = FS_TIME(hour(t), minute(t), second(t));
-  
-      // Return low time bits in units of 10 ms.
-      *ms10 = second(t) & 1 ? 100 : 0;
+    // Free cluster count, cached between calls.  Scanning the FAT is by far
+    // the slowest part of a mount on large FAT32 volumes, so we keep the
+    // count up to date ourselves and only rescan when we lose track of it.
+    int32_t freeClusters() {
+        if (_freeClusters < 0) {
+            _freeClusters = _fs.freeClusterCount();
+        }
+        return _freeClusters;
+    }
+
+    // Helper function, takes FAT and makes standard time_t, see SDFSTime.h
+    static time_t FatToTimeT(uint16_t d, uint16_t t);
+    static time_t FatToTimeT(const uint8_t * d, const uint8_t * t) {
+        return FatToTimeT((uint16_t)(d[1] << 8 | d[0]), (uint16_t)(t[1] << 8 | t[0]));
     }
+
+    // Call back for file timestamps.  Only called for file create and
+    // sync(), but that can be many times a second, so the encoding is
+    // cached for the current second.  Because SdFat has a single, global
+    // setting for this it has to be static.
+    static void dateTimeCB(uint16_t* date, uint16_t* time, uint8_t* ms10);
+
+    bool readOnly() const {
+        return _cfg._readOnly;
+    }
+
     bool sync(fs::FileMap &openFiles)
     {
      fs::FileMap::iterator itr;
@@ -294,14 +365,97 @@ public:
 
 
 protected:
-    friend class SDFileImpl;
+    friend class SDFSFileImpl;
     friend class SDFSDirImpl;
+    friend class SDFSPack;
+    friend class SDFSDirIndex;
+    friend class SDFSDataIO;
 
     SdFat* getFs()
     {
         return &_fs;
     }
 
+    // FNV-1a, used to fingerprint on-card metadata
+    static uint32_t _hash(const void *data, size_t len, uint32_t h = 2166136261UL) {
+        const uint8_t *p = (const uint8_t *)data;
+        while (len--) {
+            h = (h ^ *p++) * 16777619UL;
+        }
+        return h;
+    }
+
+    uint32_t _clusters(uint32_t bytes) {
+        uint32_t clusterBytes = _fs.sectorsPerCluster() * 512;
+        return (bytes + clusterBytes - 1) / clusterBytes;
+    }
+
+    // Called with a file's size before and after an operation.  FAT files
+    // have no holes, so the cluster count follows directly from the size.
+    void _trackAlloc(uint32_t oldSize, uint32_t newSize) {
+        if ((_freeClusters >= 0) && (oldSize != newSize)) {
+            _freeClusters -= (int32_t)(_clusters(newSize) - _clusters(oldSize));
+        }
+    }
+
+    void _invalidateFree() {
+        _freeClusters = -1;
+    }
+
+    bool _writable(const char *op) {
+        (void) op;
+        if (_cfg._readOnly) {
+            DEBUGV("SDFSImpl::%s() on a read-only mount\n", op);
+            return false;
+        }
+        return true;
+    }
+
+    static bool _mutates(OpenMode openMode, AccessMode accessMode) {
+        return (accessMode & AM_WRITE) || (openMode & (OM_CREATE | OM_APPEND | OM_TRUNCATE));
+    }
+
+    // A 255 character long name takes 20 LFN entries, plus the short entry
+    enum { MAX_ENTRY_SET = 21 };
+
+    void _trackCreate(::File &fd);
+    bool _mkdirOne(const char *path);
+    bool _mkdirs(const char *path, bool existOk);
+    bool _renameEntry(const char *pathFrom, const char *pathTo);
+    bool _removeEntry(const char *path);
+    static bool _sidecarPath(const char *path, char (&sumPath)[260]);
+    bool _isSidecar(const char *path, char (&sumPath)[260]);
+    std::shared_ptr<SDFSPack> _findPack(const char *path, const char **key);
+    std::shared_ptr<SDFSDirIndex> _findIndex(const char *path, const char **leaf);
+    ::File _open(const char *path, oflag_t flags);
+    ::File _replace(const char *path);
+    bool _rawSync();
+    bool _readSectors(uint32_t sector, uint8_t *dst, size_t ns);
+    bool _eraseSectors(uint32_t first, uint32_t last);
+    bool _extend(::File &fd, uint32_t size);
+    bool _extendErased(::File &fd);
+    bool _extendZeros(::File &fd, uint32_t from, uint32_t size);
+    uint32_t _fsInfoSector();
+    uint32_t _signature(uint32_t fsInfo);
+    void _saveWarmState();
+    bool _restoreWarmState();
+
+    template <typename T>
+    bool _beginCard(T &config) {
+#if SDFS_BLOCK_DEVICE
+        // Mount on our counting layer rather than the card itself.  vol()
+        // is whatever volume class SdFat was built with (FatVolume,
+        // ExFatVolume or FsVolume), so exFAT cards mount here too.
+        if (!_fs.cardBegin(config)) {
+            return false;
+        }
+        _io.attach(_fs.card());
+        return _fs.vol()->begin(&_io);
+#else
+        return _fs.begin(config);
+#endif
+    }
+
     static oflag_t _getFlags(OpenMode openMode, AccessMode accessMode) {
         oflag_t mode = 0;
         if (openMode & OM_CREATE) {
@@ -325,6 +479,51 @@ protected:
     SdFat _fs;
     SDFSConfig   _cfg;
     bool         _mounted;
+    int32_t      _freeClusters;
+    int8_t       _eraseZero;   // Erased sectors read as zero: 1 yes, 0 no, -1 not known yet
+    SDFSWarmState _warm;
+    std::vector<std::weak_ptr<fs::FileImpl>>   _openFiles;
+    std::vector<std::weak_ptr<SDFSDirImpl>>  _openDirs;
+    std::vector<std::weak_ptr<SDFSChecksumFileImpl>> _checksumFiles;
+    std::vector<std::shared_ptr<SDFSPack>>   _packs;
+    std::vector<std::shared_ptr<SDFSDirIndex>> _dirIndexes;
+    SDFSIOStats  _ioStats;
+    uint8_t      _ioContext;  // SDFSIOCategory for data area sectors
+#if SDFS_BLOCK_DEVICE
+    SDFSBlockDevice _io;
+#endif
+};
+
+// Counts card I/O done while it's in scope as file data, and optionally
+// the call as a file read for the cache hit counter
+class SDFSDataIO
+{
+public:
+    SDFSDataIO(SDFSImpl *fs, bool fileRead = false)
+        : _fs(fs), _saved(fs->_ioContext), _fileRead(fileRead),
+          _reads(fs->_ioStats.singleReads + fs->_ioStats.multiReads)
+    {
+        fs->_ioContext = IO_DATA;
+    }
+
+    ~SDFSDataIO()
+    {
+        _fs->_ioContext = _saved;
+        if (_fileRead) {
+            _fs->_ioStats.fileReads++;
+#if SDFS_BLOCK_DEVICE
+            if (_reads == _fs->_ioStats.singleReads + _fs->_ioStats.multiReads) {
+                _fs->_ioStats.cacheHits++;
+            }
+#endif
+        }
+    }
+
+protected:
+    SDFSImpl *_fs;
+    uint8_t   _saved;
+    bool      _fileRead;
+    uint32_t  _reads;
 };
 
 
@@ -332,7 +531,7 @@ class SDFSFileImpl : public fs::FileImpl
 {
 public:
     SDFSFileImpl(SDFSImpl *fs, std::shared_ptr<::File> fd, const char *name)
-        : _fs(fs), _fd(fd), _opened(true)
+        : _fs(fs), _fd(fd), _opened(true), _direct(-1), _firstSector(0), _pos(0), _bufSector(UINT32_MAX)
     {
         _name = std::shared_ptr<char>(new char[strlen(name) + 1], std::default_delete<char[]>());
         strcpy(_name.get(), name);
@@ -346,13 +545,27 @@ public:
 
     size_t write(const uint8_t *buf, size_t size) override
     {
-        return _opened ? _fd->write(buf, size) : -1;
+        if (!_opened) {
+            return -1;
+        }
+        SDFSDataIO io(_fs);
+        uint32_t oldSize = _fd->fileSize();
+        size_t ret = _fd->write(buf, size);
+        _fs->_trackAlloc(oldSize, _fd->fileSize());
+        return ret;
     }
 
     size_t read(uint8_t* buf, size_t size) override
     {
         DEBUGV("SDFSFileImpl::read open=%d\n", _opened);
-        return _opened ? _fd->read(buf, size) : -1;
+        if (!_opened) {
+            return -1;
+        }
+        SDFSDataIO io(_fs, true);
+        if ((_direct > 0) || ((_direct < 0) && _directBegin())) {
+            return _directRead(buf, size);
+        }
+        return _fd->read(buf, size);
     }
 
     void flush() override
@@ -368,6 +581,15 @@ public:
         if (!_opened) {
             return false;
         }
+        if (_direct > 0) {
+            // Just arithmetic, no cluster chain to follow
+            uint32_t newPos = (mode == fs::SeekSet) ? pos : (mode == fs::SeekCur) ? _pos + pos : _fd->fileSize() - pos;
+            if (newPos > _fd->fileSize()) {
+                return false;
+            }
+            _pos = newPos;
+            return true;
+        }
         switch (mode) {
             case fs::SeekSet:
                 return _fd->seekSet(pos);
@@ -385,7 +607,7 @@ public:
 
     size_t position() const override
     {
-        return _opened ? _fd->curPosition() : 0;
+        return _opened ? ((_direct > 0) ? _pos : _fd->curPosition()) : 0;
     }
 
     size_t size() const override
@@ -399,7 +621,11 @@ public:
             DEBUGV("SDFSFileImpl::truncate: file not opened\n");
             return false;
         }
-        return _fd->truncate(size);
+        uint32_t oldSize = _fd->fileSize();
+        // Growing zero fills, by erasing the card where it can
+        bool ret = (size > oldSize) ? _fs->_extend(*_fd, size) : _fd->truncate(size);
+        _fs->_trackAlloc(oldSize, _fd->fileSize());
+        return ret;
     }
 
     void close() override
@@ -407,6 +633,7 @@ public:
         if (_opened) {
             _fd->close();
             _opened = false;
+            _buf.reset();
         }
     }
 
@@ -467,10 +694,20 @@ public:
 
 
 protected:
+    bool _directBegin();
+    size_t _directRead(uint8_t *buf, size_t size);
+
     SDFSImpl*                     _fs;
     std::shared_ptr<::File>  _fd;
     std::shared_ptr<char>         _name;
     bool                          _opened;
+    // Read-only handles on large contiguous files read straight from the
+    // card by sector number, see _directBegin()
+    int8_t                        _direct;      // 1 yes, 0 no, -1 not checked yet
+    uint32_t                      _firstSector;
+    uint32_t                      _pos;
+    uint32_t                      _bufSector;   // Which sector _buf holds
+    std::unique_ptr<uint8_t[]>    _buf;         // For partial sector reads
 };
 
 class SDFSDirImpl : public fs::DirImpl
@@ -490,6 +727,12 @@ public:
         _dir->close();
     }
 
+    void close()
+    {
+        _valid = false;
+        _dir->close();
+    }
+
     fs::FileImplPtr openFile(OpenMode openMode, AccessMode accessMode) override
     {
         if (!_valid) {
@@ -590,7 +833,8 @@ public:
                 DEBUGV("next() file not open\n");
                 _valid = 0;
             }
-        } while(_valid && strncmp((const char*) _lfn, _pattern.c_str(), n) != 0);
+            // Our own index sidecar is never listed
+        } while(_valid && (strncmp((const char*) _lfn, _pattern.c_str(), n) != 0 || !strcmp(_lfn, SDFS_DIRINDEX_NAME) || _isSidecar()));
         DEBUGV("_next done vlaid=%d\n",_valid);
         return _valid;
     }
@@ -603,6 +847,15 @@ public:
     }
 protected:
     friend class SDFSImpl;
+
+    // Our own checksum sidecars carry the hidden attribute, so a user's
+    // own *.crc files still show
+    bool _isSidecar() const
+    {
+        size_t len = strlen(_lfn);
+        size_t sfx = strlen(SDFS_CHECKSUM_SUFFIX);
+        return _isHidden && (len > sfx) && !strcasecmp(_lfn + len - sfx, SDFS_CHECKSUM_SUFFIX);
+    }
     String                       _pattern;
     SDFSImpl*                    _fs;
     std::shared_ptr<::File>      _dir;
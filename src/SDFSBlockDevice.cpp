@@ -0,0 +1,86 @@
+/*
+ SDFSBlockDevice.cpp - counting layer between the FAT volume and the card
+
+ This library is free software; you can redistribute it and/or
+ modify it under the terms of the GNU Lesser General Public
+ License as published by the Free Software Foundation; either
+ version 2.1 of the License, or (at your option) any later version.
+
+ This library is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ Lesser General Public License for more details.
+
+ You should have received a copy of the GNU Lesser General Public
+ License along with this library; if not, write to the Free Software
+ Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+#include "SDFSBlockDevice.h"
+
+#if SDFS_BLOCK_DEVICE
+
+namespace sdfs {
+
+void SDFSBlockDevice::_count(uint32_t *counts, uint32_t sector, size_t ns, uint8_t context) const
+{
+    uint8_t first = _category(sector, context);
+    if ((ns == 1) || (first == _category(sector + ns - 1, context))) {
+        counts[first] += ns;
+        return;
+    }
+    // Straddles a region boundary, which is rare enough to go one by one
+    for (size_t i = 0; i < ns; i++) {
+        counts[_category(sector + i, context)]++;
+    }
+}
+
+bool SDFSBlockDevice::cardRead(uint32_t sector, uint8_t *dst, size_t ns)
+{
+    uint32_t start = micros();
+    bool ret;
+    if (ns == 1) {
+        ret = _card->readSector(sector, dst);
+        _stats->singleReads++;
+    } else {
+        ret = _card->readSectors(sector, dst, ns);
+        _stats->multiReads++;
+    }
+    _stats->readMicros += micros() - start;
+    _count(_stats->sectorsRead, sector, ns, *_context);
+    return ret;
+}
+
+bool SDFSBlockDevice::cardWrite(uint32_t sector, const uint8_t *src, size_t ns)
+{
+    uint32_t start = micros();
+    bool ret;
+    if (ns == 1) {
+        ret = _card->writeSector(sector, src);
+        _stats->singleWrites++;
+    } else {
+        ret = _card->writeSectors(sector, src, ns);
+        _stats->multiWrites++;
+    }
+    _stats->writeMicros += micros() - start;
+    return ret;
+}
+
+// A merged write can cover sectors queued for different purposes, so
+// they're counted by the tags they were queued with
+void SDFSBlockDevice::cardWritten(uint32_t sector, size_t ns, uint8_t context)
+{
+    _count(_stats->sectorsWritten, sector, ns, context);
+}
+
+bool SDFSBlockDevice::cardSync()
+{
+    uint32_t start = micros();
+    bool ret = _card->syncDevice();
+    _stats->writeMicros += micros() - start;
+    _stats->syncs++;
+    return ret;
+}
+
+}; // namespace sdfs
+
+#endif // SDFS_BLOCK_DEVICE
@@ -0,0 +1,206 @@
+#ifndef SDFSBLOCKDEVICE_H
+#define SDFSBLOCKDEVICE_H
+
+/*
+ SDFSBlockDevice.h - counting layer between the FAT volume and the card
+
+ When SdFat is built with a virtual block device interface (SDIO
+ targets, or USE_BLOCK_DEVICE_INTERFACE set in SdFatConfig.h) SDFS mounts
+ the volume on this class instead of the card itself.  It forwards every
+ command and counts sectors by what they hold and commands by kind, so
+ SDFSImpl::ioStats() can show how much card traffic, FAT and directory
+ churn and busy waiting application level writes really cause.
+
+ Sectors ahead of the FATs (MBR, boot sector, FSInfo) count as IO_FSINFO,
+ the FATs as IO_FAT, and a FAT16 root directory as IO_DIR.  The data area
+ holds both files and directories, so sectors there count as IO_DATA
+ while a plain file is being read or written and as IO_DIR otherwise.
+ That makes the last partial sector of a file written back by flush()
+ show up as directory traffic.
+
+ Commands pass through an SDFSScheduler on their way down.  It's idle
+ unless SDFSConfig::setIOScheduler() gives it a queue or setReadOnly()
+ a read cache, and the counters see the commands it actually sends to
+ the card.
+
+ On a read-only mount the device refuses every write itself, so nothing
+ that ends up here can change the card whatever SDFSImpl lets through.
+
+ Without a virtual interface the card level counters stay at zero.
+
+ This library is free software; you can redistribute it and/or
+ modify it under the terms of the GNU Lesser General Public
+ License as published by the Free Software Foundation; either
+ version 2.1 of the License, or (at your option) any later version.
+
+ This library is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ Lesser General Public License for more details.
+
+ You should have received a copy of the GNU Lesser General Public
+ License along with this library; if not, write to the Free Software
+ Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+#include <Arduino.h>
+#include <SdFat.h>
+#include "SDFSScheduler.h"
+
+#if HAS_SDIO_CLASS || USE_BLOCK_DEVICE_INTERFACE
+#define SDFS_BLOCK_DEVICE 1
+#else
+#define SDFS_BLOCK_DEVICE 0
+#endif
+
+namespace sdfs {
+
+enum SDFSIOCategory {
+    IO_DATA = 0,
+    IO_FAT,
+    IO_DIR,
+    IO_FSINFO,   // MBR, boot sector, FSInfo and the rest of the reserved area
+    IO_CATEGORIES
+};
+
+struct SDFSIOStats
+{
+    uint32_t sectorsRead[IO_CATEGORIES];
+    uint32_t sectorsWritten[IO_CATEGORIES];
+    uint32_t singleReads;   // Commands, not sectors
+    uint32_t multiReads;
+    uint32_t singleWrites;
+    uint32_t multiWrites;
+    uint32_t syncs;
+    uint32_t fileReads;     // read() calls on plain files...
+    uint32_t cacheHits;     // ...that didn't need the card at all
+    uint32_t readMicros;    // Time spent in card reads
+    uint32_t writeMicros;   // Time spent in card writes and syncs, mostly busy waiting
+};
+
+#if SDFS_BLOCK_DEVICE
+class SDFSBlockDevice : public FsBlockDeviceInterface, public SDFSSchedulerBackend
+{
+public:
+    SDFSBlockDevice(SDFSIOStats *stats, const uint8_t *context)
+        : _card(nullptr), _stats(stats), _context(context), _readOnly(false), _sched(this, _millis)
+    {
+        resetLayout();
+    }
+
+    void attach(FsBlockDevice *card)
+    {
+        _card = card;
+        resetLayout();
+    }
+
+    // Until setLayout() is called every sector counts as IO_FSINFO, which
+    // is right for what the mount itself reads.  All zeros would put
+    // every sector in the data area instead.
+    void resetLayout()
+    {
+        setLayout(UINT32_MAX, UINT32_MAX, UINT32_MAX);
+    }
+
+    void setLayout(uint32_t fatStart, uint32_t dirStart, uint32_t dataStart)
+    {
+        _fatStart = fatStart;
+        _dirStart = dirStart;
+        _dataStart = dataStart;
+    }
+
+    void setReadOnly(bool val)
+    {
+        _readOnly = val;
+    }
+
+    bool readOnly() const
+    {
+        return _readOnly;
+    }
+
+    void end() override
+    {
+        if (_card) {
+            _card->end();
+        }
+    }
+
+    bool isBusy() override
+    {
+        return _card->isBusy();
+    }
+
+    uint32_t sectorCount() override
+    {
+        return _card->sectorCount();
+    }
+
+    bool readSector(uint32_t sector, uint8_t *dst) override
+    {
+        return _sched.read(sector, dst, 1);
+    }
+
+    bool readSectors(uint32_t sector, uint8_t *dst, size_t ns) override
+    {
+        return _sched.read(sector, dst, ns);
+    }
+
+    // Queued writes remember what the data area was being used for
+    bool writeSector(uint32_t sector, const uint8_t *src) override
+    {
+        return !_readOnly && _sched.write(sector, src, 1, *_context);
+    }
+
+    bool writeSectors(uint32_t sector, const uint8_t *src, size_t ns) override
+    {
+        return !_readOnly && _sched.write(sector, src, ns, *_context);
+    }
+
+    bool syncDevice() override
+    {
+        return _sched.sync();
+    }
+
+    SDFSScheduler *scheduler()
+    {
+        return &_sched;
+    }
+
+    bool cardRead(uint32_t sector, uint8_t *dst, size_t ns) override;
+    bool cardWrite(uint32_t sector, const uint8_t *src, size_t ns) override;
+    void cardWritten(uint32_t sector, size_t ns, uint8_t context) override;
+    bool cardSync() override;
+
+protected:
+    static uint32_t _millis()
+    {
+        return millis();
+    }
+
+    uint8_t _category(uint32_t sector, uint8_t context) const
+    {
+        if (sector >= _dataStart) {
+            return context;
+        }
+        if (sector < _fatStart) {
+            return IO_FSINFO;
+        }
+        return (sector < _dirStart) ? IO_FAT : IO_DIR;
+    }
+
+    void _count(uint32_t *counts, uint32_t sector, size_t ns, uint8_t context) const;
+
+    FsBlockDevice     *_card;
+    SDFSIOStats       *_stats;
+    const uint8_t     *_context;  // What data area sectors are for right now
+    uint32_t           _fatStart;
+    uint32_t           _dirStart;   // End of the FATs
+    uint32_t           _dataStart;
+    bool               _readOnly;
+    SDFSScheduler      _sched;
+};
+#endif
+
+}; // namespace sdfs
+
+#endif // SDFSBlockDevice.h
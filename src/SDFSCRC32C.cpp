@@ -0,0 +1,118 @@
+/*
+ SDFSCRC32C.cpp - CRC32C for SDFS checksums
+
+ This library is free software; you can redistribute it and/or
+ modify it under the terms of the GNU Lesser General Public
+ License as published by the Free Software Foundation; either
+ version 2.1 of the License, or (at your option) any later version.
+
+ This library is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ Lesser General Public License for more details.
+
+ You should have received a copy of the GNU Lesser General Public
+ License along with this library; if not, write to the Free Software
+ Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+#include <stdlib.h>
+#include <string.h>
+#include "SDFSCRC32C.h"
+
+#if defined(__SSE4_2__)
+#include <nmmintrin.h>
+#elif defined(__ARM_FEATURE_CRC32)
+#include <arm_acle.h>
+#endif
+
+namespace sdfs {
+
+#define CRC32C_POLY 0x82f63b78 // Castagnoli, reflected
+
+#if !defined(__SSE4_2__) && !defined(__ARM_FEATURE_CRC32)
+// Slicing-by-8 tables, 8K, built on the heap the first time they're needed
+// so sketches that never checksum don't pay for them
+static uint32_t (*_crcTable())[256]
+{
+    static uint32_t (*table)[256] = nullptr;
+    if (!table) {
+        table = (uint32_t (*)[256]) malloc(8 * 256 * sizeof(uint32_t));
+        if (!table) {
+            return nullptr;
+        }
+        for (int i = 0; i < 256; i++) {
+            uint32_t crc = i;
+            for (int j = 0; j < 8; j++) {
+                crc = (crc >> 1) ^ ((crc & 1) ? CRC32C_POLY : 0);
+            }
+            table[0][i] = crc;
+        }
+        for (int i = 0; i < 256; i++) {
+            for (int k = 1; k < 8; k++) {
+                table[k][i] = (table[k - 1][i] >> 8) ^ table[0][table[k - 1][i] & 0xff];
+            }
+        }
+    }
+    return table;
+}
+#endif
+
+uint32_t crc32c(uint32_t crc, const void *buf, size_t len)
+{
+    const uint8_t *p = (const uint8_t *)buf;
+    crc = ~crc;
+#if defined(__SSE4_2__)
+#if defined(__x86_64__)
+    while (len >= 8) {
+        uint64_t v;
+        memcpy(&v, p, sizeof(v));
+        crc = (uint32_t)_mm_crc32_u64(crc, v);
+        p += 8;
+        len -= 8;
+    }
+#endif
+    while (len--) {
+        crc = _mm_crc32_u8(crc, *p++);
+    }
+#elif defined(__ARM_FEATURE_CRC32)
+    while (len >= 4) {
+        uint32_t v;
+        memcpy(&v, p, sizeof(v));
+        crc = __crc32cw(crc, v);
+        p += 4;
+        len -= 4;
+    }
+    while (len--) {
+        crc = __crc32cb(crc, *p++);
+    }
+#else
+    const uint32_t (*t)[256] = _crcTable();
+    if (!t) {
+        // Out of memory, go bit by bit
+        while (len--) {
+            crc ^= *p++;
+            for (int j = 0; j < 8; j++) {
+                crc = (crc >> 1) ^ ((crc & 1) ? CRC32C_POLY : 0);
+            }
+        }
+        return ~crc;
+    }
+    // All supported targets are little endian
+    while (len >= 8) {
+        uint32_t a, b;
+        memcpy(&a, p, sizeof(a));
+        memcpy(&b, p + 4, sizeof(b));
+        a ^= crc;
+        crc = t[7][a & 0xff] ^ t[6][(a >> 8) & 0xff] ^ t[5][(a >> 16) & 0xff] ^ t[4][a >> 24] ^
+              t[3][b & 0xff] ^ t[2][(b >> 8) & 0xff] ^ t[1][(b >> 16) & 0xff] ^ t[0][b >> 24];
+        p += 8;
+        len -= 8;
+    }
+    while (len--) {
+        crc = t[0][(crc ^ *p++) & 0xff] ^ (crc >> 8);
+    }
+#endif
+    return ~crc;
+}
+
+}; // namespace sdfs
@@ -0,0 +1,38 @@
+#ifndef SDFSCRC32C_H
+#define SDFSCRC32C_H
+
+/*
+ SDFSCRC32C.h - CRC32C for SDFS checksums
+
+ CRC32C (Castagnoli), with the usual pre and post inversion, using the
+ CPU's CRC instructions where the target has them and slicing-by-8
+ tables otherwise.  Pass the previous result as crc to continue over
+ more data, 0 to start.
+
+ Nothing in here depends on Arduino or SdFat, so tests/host checks it
+ against the published check values.
+
+ This library is free software; you can redistribute it and/or
+ modify it under the terms of the GNU Lesser General Public
+ License as published by the Free Software Foundation; either
+ version 2.1 of the License, or (at your option) any later version.
+
+ This library is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ Lesser General Public License for more details.
+
+ You should have received a copy of the GNU Lesser General Public
+ License along with this library; if not, write to the Free Software
+ Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+#include <stddef.h>
+#include <stdint.h>
+
+namespace sdfs {
+
+uint32_t crc32c(uint32_t crc, const void *buf, size_t len);
+
+}; // namespace sdfs
+
+#endif // SDFSCRC32C.h
@@ -0,0 +1,377 @@
+/*
+ SDFSChecksum.cpp - inline CRC32C integrity checking for SDFS files
+
+ This library is free software; you can redistribute it and/or
+ modify it under the terms of the GNU Lesser General Public
+ License as published by the Free Software Foundation; either
+ version 2.1 of the License, or (at your option) any later version.
+
+ This library is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ Lesser General Public License for more details.
+
+ You should have received a copy of the GNU Lesser General Public
+ License along with this library; if not, write to the Free Software
+ Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+#include <algorithm>
+#include "SDFSChecksum.h"
+
+namespace sdfs {
+
+static_assert(sizeof(SDFSChecksumHeader) == 16, "SDFSChecksumHeader layout");
+
+fs::FileImplPtr SDFSChecksumFileImpl::create(fs::FileImplPtr inner, fs::FileImplPtr sums, OpenMode openMode, AccessMode accessMode)
+{
+    bool writable = accessMode & AM_WRITE;
+    if (!inner || (writable && !sums)) {
+        DEBUGV("SDFSChecksumFileImpl::create() no file or sidecar\n");
+        return fs::FileImplPtr();
+    }
+    std::shared_ptr<SDFSChecksumFileImpl> f(new SDFSChecksumFileImpl(inner, sums, writable, openMode & OM_APPEND));
+    uint32_t pos = inner->position();
+    uint32_t size = inner->size();
+    SDFSChecksumHeader hdr;
+    bool valid = sums && (sums->size() >= 512) && sums->seek(0, fs::SeekSet) &&
+                 (sums->read((uint8_t *)&hdr, sizeof(hdr)) == sizeof(hdr)) &&
+                 (hdr.magic == MAGIC) && (hdr.version == VERSION) && (hdr.blockSize == BLOCK);
+    if (valid) {
+        f->_covered = std::min(hdr.size, size);
+        if (hdr.size != size) {
+            // The file changed behind our back, so its last block is suspect
+            f->_covered -= f->_covered % BLOCK;
+        }
+    }
+    if (writable && (!valid || (f->_covered != size))) {
+        DEBUGV("SDFSChecksumFileImpl::create() checksumming %u bytes\n", size - f->_covered);
+        if (!f->_rebuild(f->_covered / BLOCK)) {
+            return fs::FileImplPtr();
+        }
+        inner->seek(pos, fs::SeekSet);
+    }
+    return f;
+}
+
+bool SDFSChecksumFileImpl::_crcRange(uint32_t start, uint32_t len, uint32_t *crc)
+{
+    uint8_t buf[512];
+    _moved = true;
+    if (!_inner->seek(start, fs::SeekSet)) {
+        return false;
+    }
+    while (len) {
+        size_t n = std::min(len, (uint32_t)sizeof(buf));
+        if (_inner->read(buf, n) != n) {
+            return false;
+        }
+        *crc = crc32c(*crc, buf, n);
+        len -= n;
+    }
+    return true;
+}
+
+bool SDFSChecksumFileImpl::_rebuild(uint32_t fromBlock)
+{
+    uint32_t size = _inner->size();
+    uint32_t blocks = (size + BLOCK - 1) / BLOCK;
+    for (uint32_t b = fromBlock; b < blocks; b++) {
+        uint32_t crc = 0;
+        if (!_crcRange(b * BLOCK, _blockLen(b), &crc)) {
+            DEBUGV("SDFSChecksumFileImpl::_rebuild() read error in block %u\n", b);
+            return false;
+        }
+        _putSum(b, crc);
+    }
+    _covered = size;
+    return _flushSums() && _writeHeader();
+}
+
+bool SDFSChecksumFileImpl::_startWrite(uint32_t block, uint32_t off)
+{
+    _wrBlock = block;
+    _wrLen = off;
+    _wrCrc = 0;
+    if (off && !_crcRange(block * BLOCK, off, &_wrCrc)) {
+        DEBUGV("SDFSChecksumFileImpl::_startWrite() can't read block %u\n", block);
+        _wrBlock = -1;
+        return false;
+    }
+    return true;
+}
+
+void SDFSChecksumFileImpl::_finishWrite()
+{
+    if ((_wrBlock < 0) || !_wrPending) {
+        return;
+    }
+    // Writing into the middle of a block leaves old data after it
+    uint32_t len = _blockLen(_wrBlock);
+    if (_wrLen < len) {
+        if (!_crcRange(_wrBlock * BLOCK + _wrLen, len - _wrLen, &_wrCrc)) {
+            DEBUGV("SDFSChecksumFileImpl::_finishWrite() can't read block %d\n", _wrBlock);
+        }
+        _wrLen = len;
+    }
+    _putSum(_wrBlock, _wrCrc);
+    _wrPending = false;
+}
+
+void SDFSChecksumFileImpl::_verifyBlock(uint32_t block)
+{
+    uint32_t crc;
+    if (_rdSkip || (block * BLOCK + _blockLen(block) > _covered) || !_getSum(block, &crc)) {
+        _report.blocksUnchecked++;
+    } else if (crc == _rdCrc) {
+        _report.blocksVerified++;
+    } else {
+        DEBUGV("SDFSChecksumFileImpl: %s block %u bad crc %08x != %08x\n", _inner->fullName(), block, _rdCrc, crc);
+        _report.blocksFailed++;
+        if (_report.firstBadBlock < 0) {
+            _report.firstBadBlock = block;
+        }
+    }
+}
+
+bool SDFSChecksumFileImpl::_loadSums(uint32_t sector)
+{
+    if ((int32_t)sector == _sumSector) {
+        return true;
+    }
+    if (!_flushSums()) {
+        return false;
+    }
+    memset(_sumBuf, 0, sizeof(_sumBuf));
+    uint32_t off = 512 + sector * 512;
+    uint32_t have = _sums->size();
+    if ((have > off) && _sums->seek(off, fs::SeekSet)) {
+        size_t n = std::min(have - off, (uint32_t)sizeof(_sumBuf));
+        if (_sums->read((uint8_t *)_sumBuf, n) != n) {
+            return false;
+        }
+    }
+    _sumSector = sector;
+    return true;
+}
+
+bool SDFSChecksumFileImpl::_flushSums()
+{
+    if (!_sumsDirty) {
+        return true;
+    }
+    uint32_t off = 512 + _sumSector * 512;
+    // Fill any gap so the seek can't land past the end
+    static const uint8_t zero[32] = { 0 };
+    while (_sums->size() < off) {
+        if (!_sums->seek(0, fs::SeekEnd) ||
+            !_sums->write(zero, std::min(off - (uint32_t)_sums->size(), (uint32_t)sizeof(zero)))) {
+            return false;
+        }
+    }
+    if (!_sums->seek(off, fs::SeekSet) || (_sums->write((const uint8_t *)_sumBuf, sizeof(_sumBuf)) != sizeof(_sumBuf))) {
+        DEBUGV("SDFSChecksumFileImpl::_flushSums() write failed\n");
+        return false;
+    }
+    _sumsDirty = false;
+    return true;
+}
+
+bool SDFSChecksumFileImpl::_getSum(uint32_t block, uint32_t *crc)
+{
+    if (!_sums || !_loadSums(block / SUMS_PER_SECTOR)) {
+        return false;
+    }
+    *crc = _sumBuf[block % SUMS_PER_SECTOR];
+    return true;
+}
+
+void SDFSChecksumFileImpl::_putSum(uint32_t block, uint32_t crc)
+{
+    if (_loadSums(block / SUMS_PER_SECTOR)) {
+        _sumBuf[block % SUMS_PER_SECTOR] = crc;
+        _sumsDirty = true;
+    }
+    _hdrDirty = true;
+}
+
+bool SDFSChecksumFileImpl::_writeHeader()
+{
+    uint8_t sector[512];
+    SDFSChecksumHeader hdr;
+    memset(&hdr, 0, sizeof(hdr));
+    hdr.magic = MAGIC;
+    hdr.version = VERSION;
+    hdr.blockSize = BLOCK;
+    hdr.size = _inner->size();
+    size_t len = sizeof(hdr);
+    if (_sums->size() < sizeof(sector)) {
+        // New sidecar, pad the header out to a whole sector
+        memset(sector, 0, sizeof(sector));
+        len = sizeof(sector);
+    }
+    memcpy(sector, &hdr, sizeof(hdr));
+    if (!_sums->seek(0, fs::SeekSet) || (_sums->write(sector, len) != len)) {
+        DEBUGV("SDFSChecksumFileImpl::_writeHeader() write failed\n");
+        return false;
+    }
+    _hdrDirty = false;
+    return true;
+}
+
+size_t SDFSChecksumFileImpl::write(const uint8_t *buf, size_t size)
+{
+    if (!_opened) {
+        return -1;
+    }
+    if (!_writable) {
+        return 0;
+    }
+    uint32_t pos = _append ? _inner->size() : _inner->position();
+    uint32_t block = pos / BLOCK;
+    uint32_t off = pos % BLOCK;
+    _moved = false;
+    if (((int32_t)block != _wrBlock) || (off != _wrLen)) {
+        // Not carrying on from the last write, so settle that block and
+        // pick up whatever comes before us in this one
+        _finishWrite();
+        if (!_startWrite(block, off)) {
+            // Without what's before us the block's CRC can't be right
+            return 0;
+        }
+    }
+    if (_moved || (_inner->position() != pos)) {
+        _inner->seek(pos, fs::SeekSet);
+    }
+    size_t ret = _inner->write(buf, size);
+    if (ret > size) {
+        return ret;
+    }
+    for (size_t done = 0; done < ret; ) {
+        if (_wrLen == BLOCK) {
+            _finishWrite();
+            _startWrite(_wrBlock + 1, 0);
+        }
+        size_t n = std::min((size_t)(BLOCK - _wrLen), ret - done);
+        _wrCrc = crc32c(_wrCrc, buf + done, n);
+        _wrLen += n;
+        done += n;
+        _wrPending = true;
+    }
+    _covered = _inner->size();
+    _hdrDirty = true;
+    _rdBlock = -1;
+    return ret;
+}
+
+size_t SDFSChecksumFileImpl::read(uint8_t* buf, size_t size)
+{
+    if (!_opened) {
+        return -1;
+    }
+    uint32_t pos = _inner->position();
+    if (_wrPending) {
+        // The stored CRC for that block is behind
+        _moved = false;
+        _finishWrite();
+        if (_moved) {
+            _inner->seek(pos, fs::SeekSet);
+        }
+    }
+    size_t ret = _inner->read(buf, size);
+    if (ret > size) {
+        return ret;
+    }
+    for (size_t done = 0; done < ret; ) {
+        uint32_t p = pos + done;
+        uint32_t block = p / BLOCK;
+        uint32_t off = p % BLOCK;
+        if (((int32_t)block != _rdBlock) || (off != _rdLen)) {
+            if (_rdBlock >= 0) {
+                _report.blocksUnchecked++; // Left part way through
+            }
+            _rdBlock = block;
+            _rdLen = off;
+            _rdCrc = 0;
+            _rdSkip = off != 0;
+        }
+        uint32_t len = _blockLen(block);
+        size_t n = std::min((size_t)(len - off), ret - done);
+        if (!_rdSkip) {
+            _rdCrc = crc32c(_rdCrc, buf + done, n);
+        }
+        _rdLen += n;
+        done += n;
+        if (_rdLen == len) {
+            _verifyBlock(block);
+            _rdBlock = -1;
+        }
+    }
+    return ret;
+}
+
+void SDFSChecksumFileImpl::flush()
+{
+    if (!_opened) {
+        return;
+    }
+    if (_writable) {
+        uint32_t pos = _inner->position();
+        _moved = false;
+        _finishWrite();
+        if (_moved) {
+            _inner->seek(pos, fs::SeekSet);
+        }
+        // Data first, so the sidecar never vouches for blocks not on the card
+        _inner->flush();
+        _flushSums();
+        if (_hdrDirty) {
+            _writeHeader();
+        }
+        _sums->flush();
+    } else {
+        _inner->flush();
+    }
+}
+
+bool SDFSChecksumFileImpl::truncate(uint32_t size)
+{
+    if (!_opened || !_writable) {
+        return false;
+    }
+    uint32_t pos = _inner->position();
+    uint32_t oldSize = _inner->size();
+    _finishWrite();
+    bool ret = _inner->truncate(size);
+    size = _inner->size();
+    _wrBlock = -1;
+    _rdBlock = -1;
+    _covered = size;
+    if (size > oldSize) {
+        // Grown, checksum the new blocks and the one we ended in
+        _rebuild(oldSize / BLOCK);
+    } else if ((size % BLOCK) && !_startWrite(size / BLOCK, size % BLOCK)) {
+        // Leave the last block unchecked rather than wrongly checked
+        _covered -= size % BLOCK;
+    } else if (size % BLOCK) {
+        _wrPending = true;
+        _finishWrite();
+    }
+    _hdrDirty = true;
+    _inner->seek(std::min(pos, size), fs::SeekSet);
+    return ret;
+}
+
+void SDFSChecksumFileImpl::close()
+{
+    if (!_opened) {
+        return;
+    }
+    flush();
+    if (_sums) {
+        _sums->close();
+    }
+    _inner->close();
+    _opened = false;
+}
+
+}; // namespace sdfs
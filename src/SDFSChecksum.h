@@ -0,0 +1,195 @@
+#ifndef SDFSCHECKSUM_H
+#define SDFSCHECKSUM_H
+
+/*
+ SDFSChecksum.h - inline CRC32C integrity checking for SDFS files
+
+ Opening a file with the SDFS-specific OM_CHECKSUM bit wraps it in this
+ class.  Every 4K block of the file has a CRC32C kept in a sidecar file
+ next to it (name + SDFS_CHECKSUM_SUFFIX).  Writes update the CRC of the
+ block they land in as the data goes by, so sequential writing never
+ reads anything back.  Reads check each block once it has been read
+ from its first to its last byte and count the result in report(), so
+ verifying a recording costs no extra pass over the card.
+
+ A block only read in part (after a seek) can't be checked and counts
+ as unchecked.  Data is returned even when it fails the check; it's up
+ to the caller to look at report().
+
+ The sidecar is an ordinary file with the hidden attribute set, which
+ keeps it out of directory listings.  SDFSImpl removes or renames it
+ along with its data file, once its header shows it really is one.
+ Writing the data file without OM_CHECKSUM leaves it stale, and after a
+ crash blocks rewritten since the last flush() may show up as bad.  Opening an unchecked file for
+ writing with OM_CHECKSUM builds the sidecar in one pass first.
+
+ Layout of the sidecar:
+   0                  SDFSChecksumHeader, padded to one sector
+   512                uint32 CRC32C of each block
+
+ This library is free software; you can redistribute it and/or
+ modify it under the terms of the GNU Lesser General Public
+ License as published by the Free Software Foundation; either
+ version 2.1 of the License, or (at your option) any later version.
+
+ This library is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ Lesser General Public License for more details.
+
+ You should have received a copy of the GNU Lesser General Public
+ License along with this library; if not, write to the Free Software
+ Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+#include "SDFS.h"
+#include "SDFSCRC32C.h"
+
+namespace sdfs {
+
+struct SDFSChecksumHeader
+{
+    uint32_t magic;
+    uint16_t version;
+    uint16_t blockSize;
+    uint32_t size;       // Data file size the CRCs were last synced for
+    uint32_t reserved;
+};
+
+struct SDFSChecksumReport
+{
+    uint32_t blocksVerified;
+    uint32_t blocksFailed;
+    uint32_t blocksUnchecked;  // Read in part, or not covered by the sidecar
+    int32_t  firstBadBlock;    // -1 if none
+};
+
+class SDFSChecksumFileImpl : public fs::FileImpl
+{
+public:
+    enum { MAGIC = 0x4b434453, VERSION = 1 };  // "SDCK"
+    enum { BLOCK = 4096, SUMS_PER_SECTOR = 512 / sizeof(uint32_t) };
+
+    // Wraps an already opened file and its sidecar.  sums may be empty
+    // for readers, which then just count every block as unchecked.
+    static fs::FileImplPtr create(fs::FileImplPtr inner, fs::FileImplPtr sums, OpenMode openMode, AccessMode accessMode);
+
+    ~SDFSChecksumFileImpl() override
+    {
+        close();
+    }
+
+    size_t write(const uint8_t *buf, size_t size) override;
+    size_t read(uint8_t* buf, size_t size) override;
+    void flush() override;
+
+    bool seek(uint32_t pos, fs::SeekMode mode) override
+    {
+        return _opened ? _inner->seek(pos, mode) : false;
+    }
+
+    size_t position() const override
+    {
+        return _opened ? _inner->position() : 0;
+    }
+
+    size_t size() const override
+    {
+        return _opened ? _inner->size() : 0;
+    }
+
+    bool truncate(uint32_t size) override;
+    void close() override;
+
+    const char* name() const override
+    {
+        return _opened ? _inner->name() : nullptr;
+    }
+
+    const char* fullName() const override
+    {
+        return _opened ? _inner->fullName() : nullptr;
+    }
+
+    bool isFile() const override
+    {
+        return _opened;
+    }
+
+    bool isDirectory() const override
+    {
+        return false;
+    }
+
+    time_t getLastWrite() override
+    {
+        return _opened ? _inner->getLastWrite() : 0;
+    }
+
+    time_t getCreationTime() override
+    {
+        return _opened ? _inner->getCreationTime() : 0;
+    }
+
+    const SDFSChecksumReport &report() const
+    {
+        return _report;
+    }
+
+    void resetReport()
+    {
+        memset(&_report, 0, sizeof(_report));
+        _report.firstBadBlock = -1;
+    }
+
+protected:
+    SDFSChecksumFileImpl(fs::FileImplPtr inner, fs::FileImplPtr sums, bool writable, bool append)
+        : _inner(inner), _sums(sums), _opened(true), _writable(writable), _append(append),
+          _sumsDirty(false), _hdrDirty(false), _wrPending(false), _rdSkip(false), _moved(false), _covered(0),
+          _wrBlock(-1), _wrLen(0), _wrCrc(0), _rdBlock(-1), _rdLen(0), _rdCrc(0), _sumSector(-1)
+    {
+        resetReport();
+    }
+
+    bool _crcRange(uint32_t start, uint32_t len, uint32_t *crc);
+    bool _rebuild(uint32_t fromBlock);
+    bool _startWrite(uint32_t block, uint32_t off);
+    void _finishWrite();
+    void _verifyBlock(uint32_t block);
+    bool _loadSums(uint32_t sector);
+    bool _flushSums();
+    bool _getSum(uint32_t block, uint32_t *crc);
+    void _putSum(uint32_t block, uint32_t crc);
+    bool _writeHeader();
+
+    uint32_t _blockLen(uint32_t block) const
+    {
+        uint32_t start = block * BLOCK;
+        uint32_t sz = _inner->size();
+        return (sz <= start) ? 0 : (sz - start < BLOCK ? sz - start : (uint32_t)BLOCK);
+    }
+
+    fs::FileImplPtr     _inner;
+    fs::FileImplPtr     _sums;
+    bool                _opened;
+    bool                _writable;
+    bool                _append;
+    bool                _sumsDirty;
+    bool                _hdrDirty;
+    bool                _wrPending;  // _wrCrc not stored yet
+    bool                _rdSkip;     // Current read block started mid-way
+    bool                _moved;      // _crcRange() moved the data file position
+    uint32_t            _covered;    // Data bytes the sidecar is good for
+    int32_t             _wrBlock;    // Block the running write CRC is for
+    uint32_t            _wrLen;      // Bytes of it the CRC covers
+    uint32_t            _wrCrc;
+    int32_t             _rdBlock;
+    uint32_t            _rdLen;
+    uint32_t            _rdCrc;
+    int32_t             _sumSector;  // Which sidecar sector _sumBuf holds
+    uint32_t            _sumBuf[SUMS_PER_SECTOR];
+    SDFSChecksumReport  _report;
+};
+
+}; // namespace sdfs
+
+#endif // SDFSChecksum.h
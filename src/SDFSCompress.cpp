@@ -0,0 +1,374 @@
+/*
+ SDFSCompress.cpp - transparent block compression for SDFS files
+
+ This library is free software; you can redistribute it and/or
+ modify it under the terms of the GNU Lesser General Public
+ License as published by the Free Software Foundation; either
+ version 2.1 of the License, or (at your option) any later version.
+
+ This library is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ Lesser General Public License for more details.
+
+ You should have received a copy of the GNU Lesser General Public
+ License along with this library; if not, write to the Free Software
+ Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+#include <algorithm>
+#include "SDFSCompress.h"
+
+namespace sdfs {
+
+static_assert(sizeof(SDFSCompressHeader) == 16, "SDFSCompressHeader layout");
+static_assert(sizeof(SDFSCompressFooter) == 20, "SDFSCompressFooter layout");
+
+fs::FileImplPtr SDFSCompressFileImpl::create(fs::FileImplPtr inner, AccessMode accessMode)
+{
+    if (!inner || ((accessMode & AM_READ) && (accessMode & AM_WRITE))) {
+        DEBUGV("SDFSCompressFileImpl::create() compressed files are read or write only\n");
+        return fs::FileImplPtr();
+    }
+    bool writing = accessMode & AM_WRITE;
+    std::shared_ptr<SDFSCompressFileImpl> f(new SDFSCompressFileImpl(inner, writing));
+    if (!writing) {
+        return f->_load() ? f : fs::FileImplPtr();
+    }
+
+    f->_table.reset(new uint16_t[1 << LZ4_HASH_BITS]);
+    if (!inner->size()) {
+        SDFSCompressHeader hdr;
+        memset(&hdr, 0, sizeof(hdr));
+        hdr.magic = MAGIC;
+        hdr.version = VERSION;
+        hdr.blockSize = BLOCK;
+        if (!f->_writeAt(0, &hdr, sizeof(hdr))) {
+            return fs::FileImplPtr();
+        }
+        f->_dataEnd = sizeof(hdr);
+        f->_dirty = true; // Even an empty file gets a trailer
+        return f;
+    }
+    if (!f->_load()) {
+        return fs::FileImplPtr();
+    }
+    // Appending: a short final block is pulled back into RAM and will be
+    // written again, with the trailer, once there's more data or on close
+    if (f->_size % BLOCK) {
+        uint32_t last = f->_blocks - 1;
+        uint32_t offset;
+        if (!f->_blockOffset(last, &offset) || !f->_loadBlock(last, offset)) {
+            return fs::FileImplPtr();
+        }
+        f->_dataEnd = offset;
+        f->_blocks = last;
+        while (!f->_index.empty() && ((f->_index.size() - 1) * f->_stride >= f->_blocks)) {
+            f->_index.pop_back();
+        }
+    }
+    f->_tailCommitted = true;
+    return f;
+}
+
+bool SDFSCompressFileImpl::_readAt(uint32_t offset, void *buf, size_t len)
+{
+    return _inner->seek(offset, fs::SeekSet) && (_inner->read((uint8_t *)buf, len) == len);
+}
+
+bool SDFSCompressFileImpl::_writeAt(uint32_t offset, const void *buf, size_t len)
+{
+    return _inner->seek(offset, fs::SeekSet) && (_inner->write((const uint8_t *)buf, len) == len);
+}
+
+bool SDFSCompressFileImpl::_load()
+{
+    uint32_t fileSize = _inner->size();
+    SDFSCompressHeader hdr;
+    SDFSCompressFooter ft;
+    if ((fileSize < sizeof(hdr)) || !_readAt(0, &hdr, sizeof(hdr)) || (hdr.magic != MAGIC) ||
+        (hdr.version != VERSION) || (hdr.blockSize != BLOCK)) {
+        DEBUGV("SDFSCompressFileImpl::_load() not a compressed file\n");
+        return false;
+    }
+    if ((fileSize >= sizeof(hdr) + sizeof(ft)) && _readAt(fileSize - sizeof(ft), &ft, sizeof(ft)) &&
+        (ft.magic == FOOTER_MAGIC) && ft.stride && !(ft.stride & (ft.stride - 1)) &&
+        (ft.indexCount <= MAX_INDEX + 1) &&
+        (ft.indexCount == (ft.blockCount + ft.stride - 1) / ft.stride) &&
+        (sizeof(hdr) + ft.indexCount * sizeof(uint32_t) + sizeof(ft) <= fileSize)) {
+        uint32_t trailer = fileSize - sizeof(ft) - ft.indexCount * sizeof(uint32_t);
+        _index.resize(ft.indexCount);
+        if (!ft.indexCount || _readAt(trailer, _index.data(), ft.indexCount * sizeof(uint32_t))) {
+            _stride  = ft.stride;
+            _blocks  = ft.blockCount;
+            _size    = ft.size;
+            _dataEnd = trailer;
+            return true;
+        }
+    }
+    return _recover();
+}
+
+// No usable trailer, most likely power was lost before close().  Walk the
+// block headers to rebuild the index.  The trailer's first word is always
+// the offset of block 0 (16), which reads as a zero raw length, so the
+// walk can't run on into a stale trailer.
+bool SDFSCompressFileImpl::_recover()
+{
+    DEBUGV("SDFSCompressFileImpl::_recover() %s\n", _inner->fullName());
+    uint32_t fileSize = _inner->size();
+    uint32_t offset = sizeof(SDFSCompressHeader);
+    uint16_t bh[2];
+    _index.clear();
+    _stride = 1;
+    _blocks = 0;
+    _size = 0;
+    while ((offset + sizeof(bh) <= fileSize) && _readAt(offset, bh, sizeof(bh))) {
+        uint32_t stored = bh[0] & ~RAW_FLAG;
+        if (!stored || !bh[1] || (bh[1] > BLOCK) || (stored > BLOCK) ||
+            (offset + sizeof(bh) + stored > fileSize)) {
+            break;
+        }
+        _indexBlock(_blocks++, offset);
+        _size += bh[1];
+        offset += sizeof(bh) + stored;
+        if (bh[1] < BLOCK) {
+            break; // Only the last block may be short
+        }
+    }
+    _dataEnd = offset;
+    return true;
+}
+
+void SDFSCompressFileImpl::_indexBlock(uint32_t block, uint32_t offset)
+{
+    if (block % _stride) {
+        return;
+    }
+    _index.push_back(offset);
+    if (_index.size() > MAX_INDEX) {
+        // Keep every other entry and double the stride
+        size_t n = (_index.size() + 1) / 2;
+        for (size_t i = 0; i < n; i++) {
+            _index[i] = _index[2 * i];
+        }
+        _index.resize(n);
+        _stride *= 2;
+    }
+}
+
+bool SDFSCompressFileImpl::_blockOffset(uint32_t block, uint32_t *offset)
+{
+    uint32_t i = block / _stride;
+    if (i >= _index.size()) {
+        return false;
+    }
+    uint32_t off = _index[i];
+    for (uint32_t b = i * _stride; b < block; b++) {
+        uint16_t bh[2];
+        if (!_readAt(off, bh, sizeof(bh))) {
+            return false;
+        }
+        off += sizeof(bh) + (bh[0] & ~RAW_FLAG);
+    }
+    *offset = off;
+    return true;
+}
+
+bool SDFSCompressFileImpl::_loadBlock(uint32_t block, uint32_t offset)
+{
+    uint16_t bh[2];
+    if (!_readAt(offset, bh, sizeof(bh))) {
+        return false;
+    }
+    uint32_t stored = bh[0] & ~RAW_FLAG;
+    uint32_t rawLen = bh[1];
+    if ((stored > BLOCK) || (rawLen > BLOCK)) {
+        return false;
+    }
+    if (bh[0] & RAW_FLAG) {
+        if ((stored != rawLen) || (_inner->read(_raw, stored) != stored)) {
+            return false;
+        }
+    } else if ((_inner->read(_comp, stored) != stored) ||
+               (lz4DecompressBlock(_comp, stored, _raw, BLOCK) != (int)rawLen)) {
+        DEBUGV("SDFSCompressFileImpl::_loadBlock() block %u corrupt\n", block);
+        return false;
+    }
+    _rawLen = rawLen;
+    _curBlock = block;
+    _nextOffset = offset + sizeof(bh) + stored;
+    return true;
+}
+
+// Writes _raw as a block at offset, compressed if that saves anything
+bool SDFSCompressFileImpl::_putBlock(uint32_t offset, uint32_t *next)
+{
+    uint16_t bh[2];
+    size_t stored = lz4CompressBlock(_raw, _rawLen, _comp + sizeof(bh), BLOCK - sizeof(bh), _table.get());
+    bh[1] = _rawLen;
+    if (stored && (stored < _rawLen)) {
+        bh[0] = stored;
+        memcpy(_comp, bh, sizeof(bh));
+        if (!_writeAt(offset, _comp, sizeof(bh) + stored)) {
+            return false;
+        }
+    } else {
+        stored = _rawLen;
+        bh[0] = stored | RAW_FLAG;
+        if (!_writeAt(offset, bh, sizeof(bh)) || (_inner->write(_raw, stored) != stored)) {
+            return false;
+        }
+    }
+    *next = offset + sizeof(bh) + stored;
+    return true;
+}
+
+// Put the short final block and the trailer on the card.  They are
+// dropped again by the next write, which continues from _dataEnd.
+bool SDFSCompressFileImpl::_commitTail()
+{
+    uint32_t end = _dataEnd;
+    bool tailIndexed = false;
+    if (_rawLen) {
+        if (!_putBlock(_dataEnd, &end)) {
+            return false;
+        }
+        if (!(_blocks % _stride)) {
+            _index.push_back(_dataEnd);
+            tailIndexed = true;
+        }
+    }
+    SDFSCompressFooter ft;
+    ft.stride     = _stride;
+    ft.indexCount = _index.size();
+    ft.blockCount = _blocks + (_rawLen ? 1 : 0);
+    ft.size       = size();
+    ft.magic      = FOOTER_MAGIC;
+    bool ok = _inner->seek(end, fs::SeekSet);
+    ok = ok && (_index.empty() || (_inner->write((const uint8_t *)_index.data(), _index.size() * sizeof(uint32_t)) == _index.size() * sizeof(uint32_t)));
+    ok = ok && (_inner->write((const uint8_t *)&ft, sizeof(ft)) == sizeof(ft));
+    if (tailIndexed) {
+        _index.pop_back();
+    }
+    _inner->flush();
+    _tailCommitted = true;
+    _dirty = !ok;
+    return ok;
+}
+
+size_t SDFSCompressFileImpl::write(const uint8_t *buf, size_t size)
+{
+    if (!_opened) {
+        return -1;
+    }
+    if (!_writing) {
+        return 0;
+    }
+    if (_tailCommitted) {
+        if (!_inner->truncate(_dataEnd)) {
+            return 0;
+        }
+        _tailCommitted = false;
+    }
+    size_t done = 0;
+    while (done < size) {
+        size_t n = std::min((size_t)(BLOCK - _rawLen), size - done);
+        memcpy(_raw + _rawLen, buf + done, n);
+        _rawLen += n;
+        _dirty = true;
+        if (_rawLen == BLOCK) {
+            uint32_t next;
+            if (!_putBlock(_dataEnd, &next)) {
+                _rawLen -= n;
+                return done;
+            }
+            _indexBlock(_blocks++, _dataEnd);
+            _dataEnd = next;
+            _rawLen = 0;
+        }
+        done += n;
+    }
+    return done;
+}
+
+size_t SDFSCompressFileImpl::read(uint8_t* buf, size_t size)
+{
+    if (!_opened) {
+        return -1;
+    }
+    if (_writing) {
+        return 0;
+    }
+    size_t done = 0;
+    while ((done < size) && (_pos < _size)) {
+        int32_t block = _pos / BLOCK;
+        if (block != _curBlock) {
+            uint32_t offset;
+            if ((_curBlock >= 0) && (block == _curBlock + 1)) {
+                offset = _nextOffset; // Sequential, no need for the index
+            } else if (!_blockOffset(block, &offset)) {
+                break;
+            }
+            if (!_loadBlock(block, offset)) {
+                break;
+            }
+        }
+        uint32_t in = _pos % BLOCK;
+        if (in >= _rawLen) {
+            break;
+        }
+        size_t n = std::min((size_t)(_rawLen - in), size - done);
+        memcpy(buf + done, _raw + in, n);
+        done += n;
+        _pos += n;
+    }
+    return done;
+}
+
+void SDFSCompressFileImpl::flush()
+{
+    if (_opened && _writing && _dirty) {
+        _commitTail();
+    }
+}
+
+bool SDFSCompressFileImpl::seek(uint32_t pos, fs::SeekMode mode)
+{
+    if (!_opened) {
+        return false;
+    }
+    uint32_t target;
+    switch (mode) {
+        case fs::SeekSet:
+            target = pos;
+            break;
+        case fs::SeekEnd:
+            target = size() - pos; // Matches SDFSFileImpl, counts back from the end
+            break;
+        case fs::SeekCur:
+            target = position() + pos;
+            break;
+        default:
+            return false;
+    }
+    if (_writing) {
+        return target == size(); // Writes only ever append
+    }
+    if (target > _size) {
+        return false;
+    }
+    _pos = target; // The block is loaded by the next read()
+    return true;
+}
+
+void SDFSCompressFileImpl::close()
+{
+    if (_opened) {
+        flush();
+        _inner->close();
+        _table.reset();
+        _opened = false;
+    }
+}
+
+}; // namespace sdfs
@@ -0,0 +1,174 @@
+#ifndef SDFSCOMPRESS_H
+#define SDFSCOMPRESS_H
+
+/*
+ SDFSCompress.h - transparent block compression for SDFS files
+
+ Opening a file with the SDFS-specific OM_COMPRESS bit wraps the plain
+ SDFSFileImpl in this class.  Data is cut into 4K blocks which are each
+ compressed on their own with the LZ4 coder in SDFSLZ4.h (or stored
+ as-is if that doesn't help), so only compressed bytes reach the card.  Every
+ block starts with its stored and raw length, and a trailer holds the
+ file offset of every stride'th block, so seek() jumps to the nearest
+ indexed block and walks at most stride-1 block headers.  The stride
+ doubles whenever the index outgrows MAX_INDEX entries, which bounds the
+ RAM used no matter how long the file gets.
+
+ Layout:
+   0                  SDFSCompressHeader
+   16                 blocks: uint16 stored length (bit 15 = not
+                      compressed), uint16 raw length, data
+   trailer            uint32 offset[indexCount], SDFSCompressFooter
+
+ Only the final block may be short.  A file that was never closed has
+ no valid trailer; it is recovered by walking the block headers.
+
+ Compressed files are either read or written (appended to), never both,
+ and writes always go to the end.  size() and position() are logical,
+ uncompressed values.
+
+ This library is free software; you can redistribute it and/or
+ modify it under the terms of the GNU Lesser General Public
+ License as published by the Free Software Foundation; either
+ version 2.1 of the License, or (at your option) any later version.
+
+ This library is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ Lesser General Public License for more details.
+
+ You should have received a copy of the GNU Lesser General Public
+ License along with this library; if not, write to the Free Software
+ Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+#include "SDFS.h"
+#include "SDFSLZ4.h"
+
+namespace sdfs {
+
+struct SDFSCompressHeader
+{
+    uint32_t magic;
+    uint16_t version;
+    uint16_t blockSize;
+    uint32_t reserved[2];
+};
+
+struct SDFSCompressFooter
+{
+    uint32_t stride;
+    uint32_t indexCount;
+    uint32_t blockCount;  // Including a short final block
+    uint32_t size;
+    uint32_t magic;
+};
+
+class SDFSCompressFileImpl : public fs::FileImpl
+{
+public:
+    enum { MAGIC = 0x315a4453, FOOTER_MAGIC = 0x455a4453, VERSION = 1 };  // "SDZ1", "SDZE"
+    enum { BLOCK = 4096, MAX_INDEX = 1024, RAW_FLAG = 0x8000 };
+
+    // Wraps an already opened file; returns an empty pointer if it can't
+    // be used (bad format, or opened for both reading and writing).
+    // Writes always append, so how the file was opened doesn't matter.
+    static fs::FileImplPtr create(fs::FileImplPtr inner, AccessMode accessMode);
+
+    ~SDFSCompressFileImpl() override
+    {
+        close();
+    }
+
+    size_t write(const uint8_t *buf, size_t size) override;
+    size_t read(uint8_t* buf, size_t size) override;
+    void flush() override;
+    bool seek(uint32_t pos, fs::SeekMode mode) override;
+
+    size_t position() const override
+    {
+        return _opened ? (_writing ? size() : _pos) : 0;
+    }
+
+    size_t size() const override
+    {
+        return _opened ? (_writing ? _blocks * BLOCK + _rawLen : _size) : 0;
+    }
+
+    bool truncate(uint32_t size) override
+    {
+        (void) size;
+        return false; // Blocks can't be cut in place
+    }
+
+    void close() override;
+
+    const char* name() const override
+    {
+        return _opened ? _inner->name() : nullptr;
+    }
+
+    const char* fullName() const override
+    {
+        return _opened ? _inner->fullName() : nullptr;
+    }
+
+    bool isFile() const override
+    {
+        return _opened;
+    }
+
+    bool isDirectory() const override
+    {
+        return false;
+    }
+
+    time_t getLastWrite() override
+    {
+        return _opened ? _inner->getLastWrite() : 0;
+    }
+
+    time_t getCreationTime() override
+    {
+        return _opened ? _inner->getCreationTime() : 0;
+    }
+
+protected:
+    SDFSCompressFileImpl(fs::FileImplPtr inner, bool writing)
+        : _inner(inner), _writing(writing), _opened(true), _dirty(false), _tailCommitted(false),
+          _rawLen(0), _pos(0), _size(0), _blocks(0), _curBlock(-1), _nextOffset(0),
+          _dataEnd(0), _stride(1)
+    {
+    }
+
+    bool _load();
+    bool _recover();
+    bool _readAt(uint32_t offset, void *buf, size_t len);
+    bool _writeAt(uint32_t offset, const void *buf, size_t len);
+    bool _blockOffset(uint32_t block, uint32_t *offset);
+    bool _loadBlock(uint32_t block, uint32_t offset);
+    bool _putBlock(uint32_t offset, uint32_t *next);
+    void _indexBlock(uint32_t block, uint32_t offset);
+    bool _commitTail();
+
+    fs::FileImplPtr            _inner;
+    bool                       _writing;
+    bool                       _opened;
+    bool                       _dirty;
+    bool                       _tailCommitted;  // Short block and trailer are on the card
+    uint8_t                    _raw[BLOCK];
+    uint8_t                    _comp[BLOCK];
+    std::unique_ptr<uint16_t[]> _table;         // Match finder, writers only
+    uint32_t                   _rawLen;
+    uint32_t                   _pos;
+    uint32_t                   _size;
+    uint32_t                   _blocks;         // Writer: full blocks written. Reader: all blocks
+    int32_t                    _curBlock;       // Reader: which block _raw holds
+    uint32_t                   _nextOffset;     // Reader: where _curBlock + 1 starts
+    uint32_t                   _dataEnd;        // Where blocks end / the next one goes
+    uint32_t                   _stride;
+    std::vector<uint32_t>      _index;
+};
+
+}; // namespace sdfs
+
+#endif // SDFSCompress.h
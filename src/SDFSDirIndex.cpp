@@ -0,0 +1,486 @@
+/*
+ SDFSDirIndex.cpp - hashed name index for large SDFS directories
+
+ This library is free software; you can redistribute it and/or
+ modify it under the terms of the GNU Lesser General Public
+ License as published by the Free Software Foundation; either
+ version 2.1 of the License, or (at your option) any later version.
+
+ This library is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ Lesser General Public License for more details.
+
+ You should have received a copy of the GNU Lesser General Public
+ License along with this library; if not, write to the Free Software
+ Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+#include <ctype.h>
+#include <strings.h>
+#include "SDFSDirIndex.h"
+
+namespace sdfs {
+
+static_assert(sizeof(SDFSDirIndexSlot) == 8, "SDFSDirIndexSlot must tile a sector");
+static_assert(sizeof(SDFSDirIndexHeader) <= 512, "SDFSDirIndexHeader must fit a sector");
+
+SDFSDirIndex::SDFSDirIndex(SDFSImpl *fs, const char *dirPath)
+    : _fs(fs), _valid(false), _slotSector(-1)
+{
+    // Keep the path without leading or trailing slashes, "" for the root
+    while (*dirPath == '/') {
+        dirPath++;
+    }
+    size_t len = strlen(dirPath);
+    while (len && dirPath[len - 1] == '/') {
+        len--;
+    }
+    _dirPath = std::shared_ptr<char>(new char[len + 1], std::default_delete<char[]>());
+    memcpy(_dirPath.get(), dirPath, len);
+    _dirPath.get()[len] = 0;
+    memset(&_hdr, 0, sizeof(_hdr));
+}
+
+SDFSDirIndex::~SDFSDirIndex()
+{
+    close();
+}
+
+bool SDFSDirIndex::begin()
+{
+    close();
+    char path[260];
+    snprintf(path, sizeof(path), "/%s", _dirPath.get());
+    _dir = _fs->getFs()->open(path, O_RDONLY);
+    if (!_dir || !_dir.isDir()) {
+        DEBUGV("SDFSDirIndex::begin() `%s` is not a directory\n", path);
+        _dir.close();
+        return false;
+    }
+    if (!_idx.open(&_dir, SDFS_DIRINDEX_NAME, O_RDWR | O_CREAT)) {
+        DEBUGV("SDFSDirIndex::begin() unable to open sidecar in `%s`\n", path);
+        _dir.close();
+        return false;
+    }
+    if (!_idx.fileSize()) {
+        _fs->_trackCreate(_idx);
+    }
+    // Keep it out of listings on other hosts too
+    if (!_idx.isHidden() && !_idx.attrib(_idx.attrib() | FS_ATTRIB_HIDDEN)) {
+        DEBUGV("SDFSDirIndex::begin() unable to hide sidecar in `%s`\n", path);
+    }
+    _slotSector = -1;
+    _valid = _load() || _rebuild();
+    if (!_valid) {
+        _idx.close();
+        _dir.close();
+    }
+    return _valid;
+}
+
+void SDFSDirIndex::close()
+{
+    if (_valid) {
+        if (!_hdr.clean) {
+            _markClean();
+        }
+        _idx.close();
+        _dir.close();
+        _valid = false;
+    }
+}
+
+// Stop using an index we've lost track of.  Its header stays marked
+// dirty on disk so it gets rebuilt next time.
+void SDFSDirIndex::_drop()
+{
+    if (_valid) {
+        DEBUGV("SDFSDirIndex::_drop() `%s`\n", _dirPath.get());
+        _idx.close();
+        _dir.close();
+        _valid = false;
+    }
+}
+
+const char *SDFSDirIndex::match(const char *path) const
+{
+    const char *slash = strrchr(path, '/');
+    const char *leaf = slash ? slash + 1 : path;
+    if (!*leaf) {
+        return nullptr;
+    }
+    path += (path[0] == '/') ? 1 : 0;
+    size_t len = (slash && (slash > path)) ? slash - path : 0;
+    const char *d = _dirPath.get();
+    return ((strlen(d) == len) && !strncmp(path, d, len)) ? leaf : nullptr;
+}
+
+// FAT names compare without regard to case, so neither may the hash
+uint32_t SDFSDirIndex::nameHash(const char *name)
+{
+    uint32_t h = 2166136261UL;
+    while (*name) {
+        h = (h ^ (uint8_t)tolower(*name++)) * 16777619UL;
+    }
+    return h;
+}
+
+bool SDFSDirIndex::_load()
+{
+    if ((_idx.fileSize() < 512) || !_idx.seekSet(0) ||
+        (_idx.read(&_hdr, sizeof(_hdr)) != (int)sizeof(_hdr))) {
+        return false;
+    }
+    if ((_hdr.magic != MAGIC) || (_hdr.version != VERSION) || !_hdr.clean ||
+        (_hdr.dirCluster != _dir.firstCluster()) ||
+        (_idx.fileSize() != 512 + _hdr.slotCount * sizeof(SDFSDirIndexSlot))) {
+        DEBUGV("SDFSDirIndex::_load() `%s` index stale\n", _dirPath.get());
+        return false;
+    }
+    uint32_t size, last, hash;
+    if (!_fingerprint(&size, &last, &hash) ||
+        (size != _hdr.dirSize) || (last != _hdr.dirLast) || (hash != _hdr.dirHash)) {
+        DEBUGV("SDFSDirIndex::_load() `%s` changed by another host\n", _dirPath.get());
+        return false;
+    }
+    return true;
+}
+
+// FAT hosts add entries after the last one in use, growing the directory
+// a cluster at a time, and SdFat zeros new directory clusters.  So the
+// last sector whose first entry was ever used sits in the last cluster,
+// and appending or removing entries at the end changes it or where it
+// is.  Only names, attributes and first clusters are hashed, so sizes
+// and timestamps changing, the sidecar's own included, don't count.
+bool SDFSDirIndex::_fingerprint(uint32_t *size, uint32_t *last, uint32_t *hash)
+{
+    uint8_t sector[512];
+    uint32_t cluster = _fs->getFs()->sectorsPerCluster() * 512;
+    *size = _dir.dirSize();
+    *last = 0;
+    *hash = 2166136261UL;
+    if (!*size) {
+        return false;
+    }
+    uint32_t stop = (*size > cluster) ? *size - cluster : 0;
+    for (uint32_t pos = *size; pos > stop; ) {
+        pos -= 512;
+        if (!_dir.seekSet(pos) || (_dir.read(sector, sizeof(sector)) != (int)sizeof(sector))) {
+            return false;
+        }
+        if (!sector[0]) {
+            continue;
+        }
+        *last = pos;
+        for (size_t e = 0; (e < sizeof(sector)) && sector[e]; e += 32) {
+            *hash = SDFSImpl::_hash(sector + e, 12, *hash);
+            *hash = SDFSImpl::_hash(sector + e + 20, 2, *hash);
+            *hash = SDFSImpl::_hash(sector + e + 26, 2, *hash);
+        }
+        break;
+    }
+    return true;
+}
+
+// Fingerprint the directory as it's left and publish the index as up to
+// date.  Nothing may change the directory after this in the session
+// without touch().
+bool SDFSDirIndex::_markClean()
+{
+    if (!_fingerprint(&_hdr.dirSize, &_hdr.dirLast, &_hdr.dirHash)) {
+        return false;
+    }
+    _hdr.clean = 1;
+    return _writeHeader() && _idx.sync();
+}
+
+bool SDFSDirIndex::_writeHeader()
+{
+    uint8_t sector[512];
+    memset(sector, 0, sizeof(sector));
+    memcpy(sector, &_hdr, sizeof(_hdr));
+    return _idx.seekSet(0) && (_idx.write(sector, sizeof(sector)) == sizeof(sector));
+}
+
+bool SDFSDirIndex::_readSlot(uint32_t idx, SDFSDirIndexSlot *slot)
+{
+    int32_t sector = idx / SLOTS_PER_SECTOR;
+    if (sector != _slotSector) {
+        if (!_idx.seekSet(512 + sector * 512) ||
+            (_idx.read(_slotBuf, sizeof(_slotBuf)) != sizeof(_slotBuf))) {
+            _slotSector = -1;
+            return false;
+        }
+        _slotSector = sector;
+    }
+    memcpy(slot, _slotBuf + (idx % SLOTS_PER_SECTOR) * sizeof(SDFSDirIndexSlot), sizeof(SDFSDirIndexSlot));
+    return true;
+}
+
+bool SDFSDirIndex::_writeSlot(uint32_t idx, const SDFSDirIndexSlot *slot)
+{
+    SDFSDirIndexSlot tmp;
+    if (!_readSlot(idx, &tmp)) { // Pulls the right sector into _slotBuf
+        return false;
+    }
+    memcpy(_slotBuf + (idx % SLOTS_PER_SECTOR) * sizeof(SDFSDirIndexSlot), slot, sizeof(SDFSDirIndexSlot));
+    return _idx.seekSet(512 + _slotSector * 512) &&
+           (_idx.write(_slotBuf, sizeof(_slotBuf)) == sizeof(_slotBuf));
+}
+
+bool SDFSDirIndex::_insert(uint32_t hash, uint16_t dirIndex)
+{
+    uint32_t mask = _hdr.slotCount - 1;
+    uint32_t idx = hash & mask;
+    SDFSDirIndexSlot slot;
+    for (uint32_t i = 0; i < _hdr.slotCount; i++, idx = (idx + 1) & mask) {
+        if (!_readSlot(idx, &slot)) {
+            return false;
+        }
+        if (slot.state != SLOT_LIVE) {
+            if (slot.state == SLOT_EMPTY) {
+                _hdr.usedCount++;
+            }
+            _hdr.liveCount++;
+            slot.hash = hash;
+            slot.dirIndex = dirIndex;
+            slot.state = SLOT_LIVE;
+            return _writeSlot(idx, &slot);
+        }
+    }
+    return false;
+}
+
+// Rebuilding a 20k entry directory one random sector at a time would take
+// minutes, so the (hash, dirIndex) pairs are first streamed to a scratch
+// area after the table and then dealt into the table a RAM-sized chunk of
+// slots at a time.  The few that probe off the end of a chunk are
+// inserted normally afterwards.
+bool SDFSDirIndex::_rebuild()
+{
+    DEBUGV("SDFSDirIndex::_rebuild() `%s`\n", _dirPath.get());
+    const uint32_t slotSize = sizeof(SDFSDirIndexSlot);
+    char name[256];
+    ::File file;
+    uint32_t entries = 0;
+    _dir.rewind();
+    while (file.openNext(&_dir, O_RDONLY)) {
+        entries++;
+        file.close();
+    }
+    uint32_t slots = SLOTS_PER_SECTOR;
+    while (slots < entries * 2) {
+        slots <<= 1;
+    }
+
+    // Header plus an empty table
+    uint32_t oldSize = _idx.fileSize();
+    if (!_idx.truncate(0)) {
+        return false;
+    }
+    memset(&_hdr, 0, sizeof(_hdr));
+    _hdr.magic      = MAGIC;
+    _hdr.version    = VERSION;
+    _hdr.slotCount  = slots;
+    _hdr.dirCluster = _dir.firstCluster();
+    _slotSector = -1;
+    memset(_slotBuf, 0, sizeof(_slotBuf));
+    if (!_writeHeader()) {
+        return false;
+    }
+    for (uint32_t i = 0; i < slots / SLOTS_PER_SECTOR; i++) {
+        if (_idx.write(_slotBuf, sizeof(_slotBuf)) != sizeof(_slotBuf)) {
+            return false;
+        }
+    }
+
+    // Scratch list of every entry
+    const uint32_t scratch = 512 + slots * slotSize;
+    uint32_t count = 0;
+    SDFSDirIndexSlot rec;
+    rec.state = SLOT_LIVE;
+    rec.reserved = 0;
+    _dir.rewind();
+    while (file.openNext(&_dir, O_RDONLY)) {
+        file.getName(name, sizeof(name));
+        rec.dirIndex = file.dirIndex();
+        file.close();
+        if (!strcmp(name, SDFS_DIRINDEX_NAME)) {
+            continue;
+        }
+        rec.hash = nameHash(name);
+        memcpy(_slotBuf + (count % SLOTS_PER_SECTOR) * slotSize, &rec, slotSize);
+        if ((++count % SLOTS_PER_SECTOR) == 0) {
+            if (_idx.write(_slotBuf, sizeof(_slotBuf)) != sizeof(_slotBuf)) {
+                return false;
+            }
+        }
+    }
+    if ((count % SLOTS_PER_SECTOR) &&
+        (_idx.write(_slotBuf, sizeof(_slotBuf)) != sizeof(_slotBuf))) {
+        return false;
+    }
+
+    size_t chunkSize = 16384;
+    uint8_t *chunk = (uint8_t *)malloc(chunkSize);
+    if (!chunk) {
+        chunkSize = 4096;
+        chunk = (uint8_t *)malloc(chunkSize);
+        if (!chunk) {
+            DEBUGV("SDFSDirIndex::_rebuild() out of memory\n");
+            return false;
+        }
+    }
+    uint32_t chunkSlots = std::min((uint32_t)(chunkSize / slotSize), slots);
+    std::vector<SDFSDirIndexSlot> spills;
+    bool ok = true;
+    SDFSDirIndexSlot *table = (SDFSDirIndexSlot *)chunk;
+    for (uint32_t lo = 0; ok && (lo < slots); lo += chunkSlots) {
+        memset(chunk, 0, chunkSlots * slotSize);
+        for (uint32_t i = 0; ok && (i < count); i++) {
+            if ((i % SLOTS_PER_SECTOR) == 0) {
+                ok = _idx.seekSet(scratch + (i / SLOTS_PER_SECTOR) * 512) &&
+                     (_idx.read(_slotBuf, sizeof(_slotBuf)) == sizeof(_slotBuf));
+            }
+            memcpy(&rec, _slotBuf + (i % SLOTS_PER_SECTOR) * slotSize, slotSize);
+            uint32_t home = rec.hash & (slots - 1);
+            if ((home < lo) || (home >= lo + chunkSlots)) {
+                continue;
+            }
+            uint32_t j = home - lo;
+            while ((j < chunkSlots) && table[j].state) {
+                j++;
+            }
+            if (j < chunkSlots) {
+                table[j] = rec;
+            } else {
+                spills.push_back(rec);
+            }
+        }
+        ok = ok && _idx.seekSet(512 + lo * slotSize) &&
+             (_idx.write(chunk, chunkSlots * slotSize) == (int)(chunkSlots * slotSize));
+    }
+    free(chunk);
+    _slotSector = -1;
+    _hdr.liveCount = count - spills.size();
+    _hdr.usedCount = _hdr.liveCount;
+    for (auto &s : spills) {
+        ok = ok && _insert(s.hash, s.dirIndex);
+    }
+
+    // Drop the scratch list and publish the index as up to date
+    ok = ok && _idx.truncate(scratch);
+    _fs->_trackAlloc(oldSize, _idx.fileSize());
+    return ok && _idx.sync() && _markClean();
+}
+
+int SDFSDirIndex::find(const char *leaf, ::File *fd, oflag_t flags)
+{
+    // A short name alias (FOO~1.TXT) isn't what was hashed, so let SdFat
+    // search for it
+    if (!_valid || strchr(leaf, '~')) {
+        return -1;
+    }
+    uint32_t hash = nameHash(leaf);
+    for (int pass = 0; pass < 2; pass++) {
+        uint32_t mask = _hdr.slotCount - 1;
+        uint32_t idx = hash & mask;
+        bool stale = false;
+        SDFSDirIndexSlot slot;
+        for (uint32_t i = 0; i < _hdr.slotCount; i++, idx = (idx + 1) & mask) {
+            if (!_readSlot(idx, &slot)) {
+                return -1;
+            }
+            if (slot.state == SLOT_EMPTY) {
+                return 0;
+            }
+            if ((slot.state != SLOT_LIVE) || (slot.hash != hash)) {
+                continue;
+            }
+            // Check the entry really is the one we want.  Verify read-only
+            // so that a legitimate failure to open with the caller's flags
+            // (e.g. writing a directory) isn't mistaken for a stale index.
+            ::File f;
+            char name[256];
+            if (!f.open(&_dir, slot.dirIndex, O_RDONLY)) {
+                stale = true;
+                break;
+            }
+            f.getName(name, sizeof(name));
+            if (strcasecmp(name, leaf)) {
+                // Could be a genuine hash collision or a reused entry
+                f.close();
+                if (nameHash(name) != hash) {
+                    stale = true;
+                    break;
+                }
+                continue;
+            }
+            if (flags != O_RDONLY) {
+                f.close();
+                f.open(&_dir, slot.dirIndex, flags);
+            }
+            *fd = f;
+            return 1;
+        }
+        if (!stale) {
+            return 0;
+        }
+        if (!_rebuild()) {
+            _drop();
+            return -1;
+        }
+    }
+    return -1;
+}
+
+bool SDFSDirIndex::touch()
+{
+    if (!_valid || !_hdr.clean) {
+        return true;
+    }
+    _hdr.clean = 0;
+    return _writeHeader() && _idx.sync();
+}
+
+void SDFSDirIndex::add(const char *leaf, uint16_t dirIndex)
+{
+    if (!_valid) {
+        return;
+    }
+    // Past 3/4 full probes get long, so start over with a bigger table.
+    // The directory already holds the new entry so it gets picked up.
+    if ((_hdr.usedCount + 1) * 4 > _hdr.slotCount * 3) {
+        if (!_rebuild() || !touch()) {
+            _drop();
+        }
+        return;
+    }
+    if (!_insert(nameHash(leaf), dirIndex)) {
+        _drop();
+    }
+}
+
+void SDFSDirIndex::erase(const char *leaf, uint16_t dirIndex)
+{
+    if (!_valid) {
+        return;
+    }
+    uint32_t hash = nameHash(leaf);
+    uint32_t mask = _hdr.slotCount - 1;
+    uint32_t idx = hash & mask;
+    SDFSDirIndexSlot slot;
+    for (uint32_t i = 0; i < _hdr.slotCount; i++, idx = (idx + 1) & mask) {
+        if (!_readSlot(idx, &slot) || (slot.state == SLOT_EMPTY)) {
+            return;
+        }
+        if ((slot.state == SLOT_LIVE) && (slot.hash == hash) && (slot.dirIndex == dirIndex)) {
+            slot.state = SLOT_DELETED;
+            _hdr.liveCount--;
+            _writeSlot(idx, &slot);
+            return;
+        }
+    }
+}
+
+}; // namespace sdfs
@@ -0,0 +1,127 @@
+#ifndef SDFSDIRINDEX_H
+#define SDFSDIRINDEX_H
+
+/*
+ SDFSDirIndex.h - hashed name index for large SDFS directories
+
+ FAT directories can only be searched linearly, which gets painful with
+ tens of thousands of entries.  An index is a hidden sidecar file in the
+ directory holding an open-addressed table from name hash to the entry's
+ dirIndex, so a lookup is one table sector read plus opening the entry
+ directly by index.  Every hit is checked against the real entry name,
+ so a collision or a stale slot can never open the wrong file.
+
+ The sidecar is marked dirty on disk before the first change to the
+ directory in a session and clean again on end().  A clean sidecar also
+ records a fingerprint of the directory, its size and the names in the
+ last sector that holds entries, which catches entries another host
+ appended or removed at the end.  A dirty or damaged sidecar, a changed
+ fingerprint, or a hit that doesn't check out, causes a full rebuild.
+ Another host reusing a deleted entry further up goes unnoticed until
+ a lookup for the name it replaced fails to check out.
+
+ Layout, all offsets in bytes from the start of the sidecar:
+   0                  SDFSDirIndexHeader, padded to one sector
+   512                slotCount * SDFSDirIndexSlot
+
+ This library is free software; you can redistribute it and/or
+ modify it under the terms of the GNU Lesser General Public
+ License as published by the Free Software Foundation; either
+ version 2.1 of the License, or (at your option) any later version.
+
+ This library is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ Lesser General Public License for more details.
+
+ You should have received a copy of the GNU Lesser General Public
+ License along with this library; if not, write to the Free Software
+ Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+#include "SDFS.h"
+
+namespace sdfs {
+
+struct SDFSDirIndexHeader
+{
+    uint32_t magic;
+    uint16_t version;
+    uint8_t  clean;
+    uint8_t  reserved;
+    uint32_t slotCount;  // Always a power of two
+    uint32_t liveCount;
+    uint32_t usedCount;  // Live plus deleted slots
+    uint32_t dirCluster; // Catches the directory being recreated
+    uint32_t dirSize;    // Fingerprint of the directory when marked clean
+    uint32_t dirLast;
+    uint32_t dirHash;
+};
+
+struct SDFSDirIndexSlot
+{
+    uint32_t hash;
+    uint16_t dirIndex;
+    uint8_t  state;
+    uint8_t  reserved;
+};
+
+class SDFSDirIndex
+{
+public:
+    enum { MAGIC = 0x58494453, VERSION = 2 };  // "SDIX"
+    enum { SLOT_EMPTY = 0, SLOT_LIVE = 1, SLOT_DELETED = 2 };
+    enum { SLOTS_PER_SECTOR = 512 / sizeof(SDFSDirIndexSlot) };
+
+    SDFSDirIndex(SDFSImpl *fs, const char *dirPath);
+    ~SDFSDirIndex();
+
+    bool begin();
+    void close();
+
+    bool valid() const {
+        return _valid;
+    }
+    const char *dirPath() const {
+        return _dirPath.get();
+    }
+    // Returns the leaf name if path is an entry directly in our directory
+    const char *match(const char *path) const;
+
+    // Opens leaf into *fd if it exists.  Returns 1 if found, 0 if it
+    // definitely doesn't exist, and -1 if the index can't say.
+    int find(const char *leaf, ::File *fd, oflag_t flags);
+    // Must be called before the directory itself is changed
+    bool touch();
+    void add(const char *leaf, uint16_t dirIndex);
+    void erase(const char *leaf, uint16_t dirIndex);
+
+    ::File *dir() {
+        return &_dir;
+    }
+
+    static uint32_t nameHash(const char *name);
+
+protected:
+    bool _load();
+    bool _rebuild();
+    void _drop();
+    bool _readSlot(uint32_t idx, SDFSDirIndexSlot *slot);
+    bool _writeSlot(uint32_t idx, const SDFSDirIndexSlot *slot);
+    bool _insert(uint32_t hash, uint16_t dirIndex);
+    bool _writeHeader();
+    bool _fingerprint(uint32_t *size, uint32_t *last, uint32_t *hash);
+    bool _markClean();
+
+    SDFSImpl               *_fs;
+    std::shared_ptr<char>   _dirPath;
+    ::File                  _dir;
+    ::File                  _idx;
+    bool                    _valid;
+    SDFSDirIndexHeader      _hdr;
+    uint8_t                 _slotBuf[512];
+    int32_t                 _slotSector;  // Which table sector _slotBuf holds
+};
+
+}; // namespace sdfs
+
+#endif // SDFSDirIndex.h
@@ -71,10 +71,28 @@ public:
 	return rtn;
     }
   #define ERASE_SIZE 262144L
-  bool erase(SdFat *_fs, SdioConfig * sdio, SdSpiConfig * spi) {
-      uint32_t firstBlock = 0;
-      uint32_t lastBlock;
+  // Erases sectors firstBlock..lastBlock, ERASE_SIZE at a time.  Also used
+  // to zero freshly allocated clusters on cards whose erased sectors read
+  // back as zeros.
+  static bool eraseRange(SdCard *card, uint32_t firstBlock, uint32_t lastBlock) {
       uint16_t n = 0;
+      do {
+        uint32_t endBlock = firstBlock + ERASE_SIZE - 1;
+        if (endBlock > lastBlock) {
+          endBlock = lastBlock;
+        }
+        if (!card->erase(firstBlock, endBlock)) {
+          return false;
+        }
+        if ((n++)%64 == 63) {
+           yield();
+        }
+        firstBlock += ERASE_SIZE;
+      } while (firstBlock <= lastBlock);
+      return true;
+  }
+
+  bool erase(SdFat *_fs, SdioConfig * sdio, SdSpiConfig * spi) {
       uint8_t  sectorBuffer[512];
       SdCardFactory cardFactory;
       //card  = _fs->card();
@@ -92,19 +110,9 @@ public:
         }
       cardSizeSectors = card->sectorCount();
 
-      do {
-        lastBlock = firstBlock + ERASE_SIZE - 1;
-        if (lastBlock >= cardSizeSectors) {
-          lastBlock = cardSizeSectors - 1;
-        }
-        if (!card->erase(firstBlock, lastBlock)) {
-          return false;
-        }
-        if ((n++)%64 == 63) {
-           yield();
-        }
-        firstBlock += ERASE_SIZE;
-      } while (firstBlock < cardSizeSectors);
+      if (!eraseRange(card, 0, cardSizeSectors - 1)) {
+        return false;
+      }
 
       if (!card->readSector(0, sectorBuffer)) {
          return false;
@@ -0,0 +1,167 @@
+/*
+ SDFSLZ4.cpp - LZ4 block coder for compressed SDFS files
+
+ This library is free software; you can redistribute it and/or
+ modify it under the terms of the GNU Lesser General Public
+ License as published by the Free Software Foundation; either
+ version 2.1 of the License, or (at your option) any later version.
+
+ This library is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ Lesser General Public License for more details.
+
+ You should have received a copy of the GNU Lesser General Public
+ License along with this library; if not, write to the Free Software
+ Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+#include <string.h>
+#include "SDFSLZ4.h"
+
+namespace sdfs {
+
+static inline uint32_t _read32(const uint8_t *p)
+{
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static inline size_t _putLength(uint8_t *dst, size_t len)
+{
+    size_t n = 0;
+    while (len >= 255) {
+        dst[n++] = 255;
+        len -= 255;
+    }
+    dst[n++] = len;
+    return n;
+}
+
+// LZ4 block format: token (literal length << 4 | match length - 4), any
+// extra length bytes, the literals, a 16 bit match offset and any extra
+// match length bytes.  The last sequence is literals only.  Returns 0 if
+// the result wouldn't fit in cap.  table is scratch space for the
+// match finder, 1 << LZ4_HASH_BITS entries.
+size_t lz4CompressBlock(const uint8_t *src, size_t len, uint8_t *dst, size_t cap, uint16_t *table)
+{
+    const size_t MINMATCH = 4, LASTLITERALS = 5, MFLIMIT = 12;
+    size_t ip = 0, anchor = 0, op = 0;
+    memset(table, 0, sizeof(uint16_t) << LZ4_HASH_BITS);
+    if (len > MFLIMIT) {
+        const size_t limit = len - MFLIMIT;
+        const size_t matchLimit = len - LASTLITERALS;
+        while (ip < limit) {
+            uint32_t seq = _read32(src + ip);
+            uint32_t h = (uint32_t)(seq * 2654435761U) >> (32 - LZ4_HASH_BITS);
+            size_t ref = table[h];
+            table[h] = ip;
+            if ((ref >= ip) || (_read32(src + ref) != seq)) {
+                // Step further through data that isn't matching
+                ip += 1 + ((ip - anchor) >> 6);
+                continue;
+            }
+            size_t mlen = MINMATCH;
+            while ((ip + mlen < matchLimit) && (src[ref + mlen] == src[ip + mlen])) {
+                mlen++;
+            }
+            size_t lit = ip - anchor;
+            if (op + 1 + lit / 255 + 1 + lit + 2 + (mlen - MINMATCH) / 255 + 1 > cap) {
+                return 0;
+            }
+            uint8_t *token = dst + op++;
+            if (lit >= 15) {
+                *token = 15 << 4;
+                op += _putLength(dst + op, lit - 15);
+            } else {
+                *token = lit << 4;
+            }
+            memcpy(dst + op, src + anchor, lit);
+            op += lit;
+            size_t offset = ip - ref;
+            dst[op++] = offset & 0xff;
+            dst[op++] = offset >> 8;
+            size_t ml = mlen - MINMATCH;
+            if (ml >= 15) {
+                *token |= 15;
+                op += _putLength(dst + op, ml - 15);
+            } else {
+                *token |= ml;
+            }
+            ip += mlen;
+            anchor = ip;
+        }
+    }
+    size_t lit = len - anchor;
+    if (op + 1 + lit / 255 + 1 + lit > cap) {
+        return 0;
+    }
+    uint8_t *token = dst + op++;
+    if (lit >= 15) {
+        *token = 15 << 4;
+        op += _putLength(dst + op, lit - 15);
+    } else {
+        *token = lit << 4;
+    }
+    memcpy(dst + op, src + anchor, lit);
+    return op + lit;
+}
+
+// Returns the decoded length, or -1 if the input is malformed
+int lz4DecompressBlock(const uint8_t *src, size_t len, uint8_t *dst, size_t cap)
+{
+    size_t ip = 0, op = 0;
+    while (ip < len) {
+        uint8_t token = src[ip++];
+        size_t lit = token >> 4;
+        if (lit == 15) {
+            uint8_t b;
+            do {
+                if (ip >= len) {
+                    return -1;
+                }
+                b = src[ip++];
+                lit += b;
+            } while (b == 255);
+        }
+        if ((ip + lit > len) || (op + lit > cap)) {
+            return -1;
+        }
+        memcpy(dst + op, src + ip, lit);
+        ip += lit;
+        op += lit;
+        if (ip == len) {
+            break; // Final literal-only sequence
+        }
+        if (ip + 2 > len) {
+            return -1;
+        }
+        size_t offset = src[ip] | (src[ip + 1] << 8);
+        ip += 2;
+        if (!offset || (offset > op)) {
+            return -1;
+        }
+        size_t ml = token & 15;
+        if (ml == 15) {
+            uint8_t b;
+            do {
+                if (ip >= len) {
+                    return -1;
+                }
+                b = src[ip++];
+                ml += b;
+            } while (b == 255);
+        }
+        ml += 4;
+        if (op + ml > cap) {
+            return -1;
+        }
+        // Matches may overlap their own output, so go a byte at a time
+        for (size_t i = 0; i < ml; i++, op++) {
+            dst[op] = dst[op - offset];
+        }
+    }
+    return op;
+}
+
+}; // namespace sdfs
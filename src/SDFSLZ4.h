@@ -0,0 +1,41 @@
+#ifndef SDFSLZ4_H
+#define SDFSLZ4_H
+
+/*
+ SDFSLZ4.h - LZ4 block coder for compressed SDFS files
+
+ A small coder for the LZ4 block format, one self-contained block at a
+ time, used by SDFSCompressFileImpl for its 4K blocks.  The compressor
+ does a single hash probe per position, which is fast and needs only an
+ 8K table, at some cost in ratio.
+
+ Nothing in here depends on Arduino or SdFat, so tests/host round-trips
+ it directly.
+
+ This library is free software; you can redistribute it and/or
+ modify it under the terms of the GNU Lesser General Public
+ License as published by the Free Software Foundation; either
+ version 2.1 of the License, or (at your option) any later version.
+
+ This library is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ Lesser General Public License for more details.
+
+ You should have received a copy of the GNU Lesser General Public
+ License along with this library; if not, write to the Free Software
+ Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+#include <stddef.h>
+#include <stdint.h>
+
+namespace sdfs {
+
+enum { LZ4_HASH_BITS = 12 };
+
+size_t lz4CompressBlock(const uint8_t *src, size_t len, uint8_t *dst, size_t cap, uint16_t *table);
+int lz4DecompressBlock(const uint8_t *src, size_t len, uint8_t *dst, size_t cap);
+
+}; // namespace sdfs
+
+#endif // SDFSLZ4.h
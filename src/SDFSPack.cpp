@@ -0,0 +1,505 @@
+/*
+ SDFSPack.cpp - packed small-file archive for SDFS
+
+ This library is free software; you can redistribute it and/or
+ modify it under the terms of the GNU Lesser General Public
+ License as published by the Free Software Foundation; either
+ version 2.1 of the License, or (at your option) any later version.
+
+ This library is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ Lesser General Public License for more details.
+
+ You should have received a copy of the GNU Lesser General Public
+ License along with this library; if not, write to the Free Software
+ Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+#include <algorithm>
+#include "SDFSPack.h"
+
+namespace sdfs {
+
+static_assert(sizeof(SDFSPackSlot) == 64, "SDFSPackSlot must tile a sector");
+static_assert(sizeof(SDFSPackHeader) <= 512, "SDFSPackHeader must fit a sector");
+
+#define NO_SLOT 0xffffffffUL
+
+SDFSPack::SDFSPack(SDFSImpl *fs, const char *mountPoint)
+    : _fs(fs), _valid(false), _readOnly(false), _slotSector(-1), _writer(nullptr)
+{
+    // Keep the mount point without any trailing slash
+    size_t len = strlen(mountPoint);
+    while (len && mountPoint[len - 1] == '/') {
+        len--;
+    }
+    _mountPoint = std::shared_ptr<char>(new char[len + 1], std::default_delete<char[]>());
+    memcpy(_mountPoint.get(), mountPoint, len);
+    _mountPoint.get()[len] = 0;
+    memset(&_hdr, 0, sizeof(_hdr));
+}
+
+SDFSPack::~SDFSPack()
+{
+    close();
+}
+
+bool SDFSPack::begin(const char *packPath, uint32_t capacity, uint32_t maxEntries)
+{
+    // Readers on a read-only mount can serve an existing pack, but not
+    // create one
+    _readOnly = _fs->readOnly();
+    _fd = _fs->_open(packPath, _readOnly ? O_RDONLY : (O_RDWR | O_CREAT));
+    if (!_fd || (_readOnly && !_fd.fileSize())) {
+        DEBUGV("SDFSPack::begin() unable to open `%s`\n", packPath);
+        _fd.close();
+        return false;
+    }
+    if (_fd.fileSize()) {
+        // On exFAT fileSize() only goes as far as the pack has been
+        // written, so check the capacity against what's allocated
+        uint32_t first, last;
+        if (!_readAt(0, &_hdr, sizeof(_hdr)) || (_hdr.magic != MAGIC) ||
+            (_hdr.version != VERSION) || (_hdr.slotSize != sizeof(SDFSPackSlot)) ||
+            (_hdr.capacity < _fd.fileSize()) || !_fd.contiguousRange(&first, &last) ||
+            ((uint64_t)(last - first + 1) * 512 < _hdr.capacity)) {
+            DEBUGV("SDFSPack::begin() `%s` is not a pack\n", packPath);
+            _fd.close();
+            return false;
+        }
+        _valid = true;
+        return true;
+    }
+
+    // New pack.  Size the table for a load factor of at most 3/4.
+    uint32_t slots = SLOTS_PER_SECTOR;
+    while (slots < maxEntries + maxEntries / 3) {
+        slots <<= 1;
+    }
+    uint32_t dataStart = 512 + slots * sizeof(SDFSPackSlot);
+    if (capacity <= dataStart) {
+        DEBUGV("SDFSPack::begin() capacity %u too small\n", capacity);
+        _fd.remove();
+        return false;
+    }
+    // One contiguous allocation up front, so appends never touch the FAT
+    if (!_fd.preAllocate(capacity)) {
+        DEBUGV("SDFSPack::begin() unable to preallocate %u bytes\n", capacity);
+        _fd.remove();
+        return false;
+    }
+    _fs->_trackAlloc(0, capacity);
+
+    memset(&_hdr, 0, sizeof(_hdr));
+    _hdr.magic     = MAGIC;
+    _hdr.version   = VERSION;
+    _hdr.slotSize  = sizeof(SDFSPackSlot);
+    _hdr.slotCount = slots;
+    _hdr.dataStart = dataStart;
+    _hdr.dataEnd   = dataStart;
+    _hdr.capacity  = capacity;
+
+    // Preallocated clusters hold whatever was there before, so the table
+    // has to be cleared explicitly
+    memset(_slotBuf, 0, sizeof(_slotBuf));
+    _slotSector = -1;
+    if (!_fd.seekSet(512)) {
+        return false;
+    }
+    for (uint32_t i = 0; i < slots / SLOTS_PER_SECTOR; i++) {
+        if (_fd.write(_slotBuf, sizeof(_slotBuf)) != sizeof(_slotBuf)) {
+            DEBUGV("SDFSPack::begin() unable to clear slot table\n");
+            return false;
+        }
+    }
+    _valid = _writeHeader() && _fd.sync();
+    return _valid;
+}
+
+void SDFSPack::close()
+{
+    if (_writer) {
+        _writer->close();
+    }
+    if (_valid) {
+        _fd.close();
+        _valid = false;
+    }
+}
+
+const char *SDFSPack::match(const char *path) const
+{
+    const char *m = _mountPoint.get();
+    m += (m[0] == '/') ? 1 : 0;
+    path += (path[0] == '/') ? 1 : 0;
+    size_t len = strlen(m);
+    if (strncmp(path, m, len)) {
+        return nullptr;
+    }
+    if (path[len] == 0) {
+        return path + len;
+    }
+    return (path[len] == '/') ? path + len + 1 : nullptr;
+}
+
+bool SDFSPack::_readAt(uint32_t offset, void *buf, size_t len)
+{
+    return _fd.seekSet(offset) && (_fd.read(buf, len) == (int)len);
+}
+
+bool SDFSPack::_writeAt(uint32_t offset, const void *buf, size_t len)
+{
+    return _fd.seekSet(offset) && (_fd.write(buf, len) == (int)len);
+}
+
+bool SDFSPack::_writeHeader()
+{
+    uint8_t sector[512];
+    memset(sector, 0, sizeof(sector));
+    memcpy(sector, &_hdr, sizeof(_hdr));
+    return _writeAt(0, sector, sizeof(sector));
+}
+
+bool SDFSPack::_readSlot(uint32_t idx, SDFSPackSlot *slot)
+{
+    int32_t sector = idx / SLOTS_PER_SECTOR;
+    if (sector != _slotSector) {
+        if (!_readAt(512 + sector * 512, _slotBuf, sizeof(_slotBuf))) {
+            _slotSector = -1;
+            return false;
+        }
+        _slotSector = sector;
+    }
+    memcpy(slot, _slotBuf + (idx % SLOTS_PER_SECTOR) * sizeof(SDFSPackSlot), sizeof(SDFSPackSlot));
+    return true;
+}
+
+bool SDFSPack::_writeSlot(uint32_t idx, const SDFSPackSlot *slot)
+{
+    SDFSPackSlot tmp;
+    if (!_readSlot(idx, &tmp)) { // Pulls the right sector into _slotBuf
+        return false;
+    }
+    memcpy(_slotBuf + (idx % SLOTS_PER_SECTOR) * sizeof(SDFSPackSlot), slot, sizeof(SDFSPackSlot));
+    return _writeAt(512 + _slotSector * 512, _slotBuf, sizeof(_slotBuf));
+}
+
+// Linear probe from the key's hash.  Returns the slot holding key, or -1
+// with *freeSlot set to where it could be inserted (NO_SLOT if full).
+int32_t SDFSPack::_find(const char *key, uint32_t *freeSlot)
+{
+    *freeSlot = NO_SLOT;
+    size_t len = strlen(key);
+    if (!len || (len > MAX_KEY)) {
+        return -1;
+    }
+    uint32_t hash = SDFSImpl::_hash(key, len);
+    uint32_t mask = _hdr.slotCount - 1;
+    uint32_t idx = hash & mask;
+    SDFSPackSlot slot;
+    for (uint32_t i = 0; i < _hdr.slotCount; i++, idx = (idx + 1) & mask) {
+        if (!_readSlot(idx, &slot)) {
+            return -1;
+        }
+        if (slot.state == SLOT_EMPTY) {
+            if (*freeSlot == NO_SLOT) {
+                *freeSlot = idx;
+            }
+            return -1;
+        } else if (slot.state == SLOT_DELETED) {
+            if (*freeSlot == NO_SLOT) {
+                *freeSlot = idx;
+            }
+        } else if ((slot.hash == hash) && (slot.nameLen == len) && !memcmp(slot.name, key, len)) {
+            return idx;
+        }
+    }
+    return -1;
+}
+
+// Copy a blob to the tail so it can be extended in place.  Only the data
+// moves here; the slot is repointed when the writer commits.
+bool SDFSPack::_moveToTail(SDFSPackSlot *slot)
+{
+    uint32_t dst = _hdr.dataEnd;
+    if (dst + slot->length > _hdr.capacity) {
+        DEBUGV("SDFSPack::_moveToTail() pack full\n");
+        return false;
+    }
+    _slotSector = -1; // _slotBuf is reused as the copy buffer
+    for (uint32_t done = 0; done < slot->length; ) {
+        uint32_t n = std::min((uint32_t)sizeof(_slotBuf), slot->length - done);
+        if (!_readAt(slot->offset + done, _slotBuf, n) || !_writeAt(dst + done, _slotBuf, n)) {
+            return false;
+        }
+        done += n;
+    }
+    slot->offset = dst;
+    return true;
+}
+
+bool SDFSPack::_commit(SDFSPackFileImpl *f)
+{
+    if (!f->_dirty) {
+        return true;
+    }
+    uint32_t freeSlot;
+    int32_t idx = _find(f->_key, &freeSlot);
+    if ((idx < 0) && (freeSlot == NO_SLOT)) {
+        DEBUGV("SDFSPack::_commit() table full\n");
+        return false;
+    }
+    SDFSPackSlot slot;
+    memset(&slot, 0, sizeof(slot));
+    slot.nameLen = strlen(f->_key);
+    memcpy(slot.name, f->_key, slot.nameLen);
+    slot.hash    = SDFSImpl::_hash(slot.name, slot.nameLen);
+    slot.offset  = f->_offset;
+    slot.length  = f->_length;
+    slot.state   = SLOT_LIVE;
+    // The writer always owns the tail.  Advance dataEnd before publishing
+    // the slot so a crash in between only leaks space.
+    _hdr.dataEnd = f->_offset + f->_length;
+    if (idx < 0) {
+        _hdr.liveCount++;
+    }
+    if (!_writeHeader() || !_writeSlot((idx < 0) ? freeSlot : idx, &slot) || !_fd.sync()) {
+        return false;
+    }
+    f->_dirty = false;
+    return true;
+}
+
+fs::FileImplPtr SDFSPack::open(const char *key, OpenMode openMode, AccessMode accessMode)
+{
+    if (!_valid) {
+        return fs::FileImplPtr();
+    }
+    char fullName[128];
+    snprintf(fullName, sizeof(fullName), "%s/%s", _mountPoint.get(), key);
+    uint32_t freeSlot;
+    int32_t idx = _find(key, &freeSlot);
+    SDFSPackSlot slot;
+    if (idx >= 0 && !_readSlot(idx, &slot)) {
+        return fs::FileImplPtr();
+    }
+
+    if (!(accessMode & AM_WRITE)) {
+        if (idx < 0) {
+            return fs::FileImplPtr();
+        }
+        return std::make_shared<SDFSPackFileImpl>(shared_from_this(), fullName, key, slot.offset, slot.length, false);
+    }
+    if (_readOnly) {
+        DEBUGV("SDFSPack::open() `%s` is read-only\n", _mountPoint.get());
+        return fs::FileImplPtr();
+    }
+
+    if (_writer) {
+        DEBUGV("SDFSPack::open() `%s` busy writing `%s`\n", _mountPoint.get(), _writer->_key);
+        return fs::FileImplPtr();
+    }
+    if ((idx < 0) && (!(openMode & OM_CREATE) || (freeSlot == NO_SLOT))) {
+        return fs::FileImplPtr();
+    }
+    uint32_t offset = _hdr.dataEnd;
+    uint32_t length = 0;
+    bool dirty = true;
+    if (idx >= 0) {
+        if (slot.offset + slot.length == _hdr.dataEnd) {
+            // Already the last blob, grow or rewrite it where it is
+            offset = slot.offset;
+            length = (openMode & OM_TRUNCATE) ? 0 : slot.length;
+            dirty = (openMode & OM_TRUNCATE);
+        } else if (!(openMode & OM_TRUNCATE)) {
+            if (!_moveToTail(&slot)) {
+                return fs::FileImplPtr();
+            }
+            offset = slot.offset;
+            length = slot.length;
+        }
+    }
+    auto f = std::make_shared<SDFSPackFileImpl>(shared_from_this(), fullName, key, offset, length, true);
+    f->_dirty = dirty;
+    if (openMode & OM_APPEND) {
+        f->_pos = length;
+    }
+    _writer = f.get();
+    return f;
+}
+
+fs::DirImplPtr SDFSPack::openDir()
+{
+    if (!_valid) {
+        return fs::DirImplPtr();
+    }
+    return std::make_shared<SDFSPackDirImpl>(shared_from_this());
+}
+
+bool SDFSPack::exists(const char *key)
+{
+    if (!_valid) {
+        return false;
+    }
+    if (!key[0]) {
+        return true; // The mount point itself
+    }
+    uint32_t freeSlot;
+    return _find(key, &freeSlot) >= 0;
+}
+
+bool SDFSPack::remove(const char *key)
+{
+    if (!_valid || _readOnly || (_writer && !strcmp(_writer->_key, key))) {
+        return false;
+    }
+    uint32_t freeSlot;
+    int32_t idx = _find(key, &freeSlot);
+    SDFSPackSlot slot;
+    if ((idx < 0) || !_readSlot(idx, &slot)) {
+        return false;
+    }
+    slot.state = SLOT_DELETED;
+    _hdr.liveCount--;
+    return _writeSlot(idx, &slot) && _writeHeader() && _fd.sync();
+}
+
+bool SDFSPack::rename(const char *keyFrom, const char *keyTo)
+{
+    if (!_valid || _readOnly || _writer) {
+        return false;
+    }
+    uint32_t freeSlot;
+    int32_t from = _find(keyFrom, &freeSlot);
+    SDFSPackSlot slot;
+    if ((from < 0) || !_readSlot(from, &slot)) {
+        return false;
+    }
+    if ((_find(keyTo, &freeSlot) >= 0) || (freeSlot == NO_SLOT)) {
+        return false;
+    }
+    // Publish the new name before retiring the old one
+    SDFSPackSlot renamed = slot;
+    memset(renamed.name, 0, sizeof(renamed.name));
+    renamed.nameLen = strlen(keyTo);
+    memcpy(renamed.name, keyTo, renamed.nameLen);
+    renamed.hash = SDFSImpl::_hash(renamed.name, renamed.nameLen);
+    if (!_writeSlot(freeSlot, &renamed)) {
+        return false;
+    }
+    slot.state = SLOT_DELETED;
+    return _writeSlot(from, &slot) && _fd.sync();
+}
+
+size_t SDFSPackFileImpl::write(const uint8_t *buf, size_t size)
+{
+    if (!_opened) {
+        return -1;
+    }
+    if (!_writing) {
+        return 0;
+    }
+    uint32_t room = _pack->_hdr.capacity - _offset - _pos;
+    if (size > room) {
+        DEBUGV("SDFSPackFileImpl::write() pack full\n");
+        size = room;
+    }
+    if (!size || !_pack->_writeAt(_offset + _pos, buf, size)) {
+        return 0;
+    }
+    _pos += size;
+    if (_pos > _length) {
+        _length = _pos;
+    }
+    _dirty = true;
+    return size;
+}
+
+size_t SDFSPackFileImpl::read(uint8_t* buf, size_t size)
+{
+    if (!_opened) {
+        return -1;
+    }
+    size = std::min((uint32_t)size, _length - _pos);
+    if (!size || !_pack->_readAt(_offset + _pos, buf, size)) {
+        return 0;
+    }
+    _pos += size;
+    return size;
+}
+
+void SDFSPackFileImpl::flush()
+{
+    if (_opened && _writing) {
+        _pack->_commit(this);
+    }
+}
+
+bool SDFSPackFileImpl::seek(uint32_t pos, fs::SeekMode mode)
+{
+    if (!_opened) {
+        return false;
+    }
+    uint32_t target;
+    switch (mode) {
+        case fs::SeekSet:
+            target = pos;
+            break;
+        case fs::SeekEnd:
+            target = _length - pos; // Matches SDFSFileImpl, counts back from the end
+            break;
+        case fs::SeekCur:
+            target = _pos + pos;
+            break;
+        default:
+            return false;
+    }
+    if (target > _length) {
+        return false;
+    }
+    _pos = target;
+    return true;
+}
+
+bool SDFSPackFileImpl::truncate(uint32_t size)
+{
+    if (!_opened || !_writing || (size > _length)) {
+        return false;
+    }
+    _length = size;
+    if (_pos > _length) {
+        _pos = _length;
+    }
+    _dirty = true;
+    return true;
+}
+
+void SDFSPackFileImpl::close()
+{
+    if (_opened) {
+        if (_writing) {
+            flush();
+            _pack->_writer = nullptr;
+        }
+        _opened = false;
+    }
+}
+
+bool SDFSPackDirImpl::next()
+{
+    while (_next < _pack->_hdr.slotCount) {
+        if (!_pack->_valid || !_pack->_readSlot(_next++, &_slot)) {
+            break;
+        }
+        if (_slot.state == SDFSPack::SLOT_LIVE) {
+            memcpy(_key, _slot.name, _slot.nameLen);
+            _key[_slot.nameLen] = 0;
+            _valid = true;
+            return true;
+        }
+    }
+    _valid = false;
+    return false;
+}
+
+}; // namespace sdfs
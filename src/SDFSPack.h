@@ -0,0 +1,239 @@
+#ifndef SDFSPACK_H
+#define SDFSPACK_H
+
+/*
+ SDFSPack.h - packed small-file archive for SDFS
+
+ Many small files on FAT each cost a whole cluster plus a directory entry,
+ and every open is a linear directory scan.  A pack is one preallocated,
+ contiguous file holding an open-addressed hash table of named blobs and
+ an append-only data area.  Lookups are a hash probe (normally a single
+ sector read) and appends only write inside the preallocated region, so
+ the FAT is never touched after the pack is created.
+
+ Layout, all offsets in bytes from the start of the pack file:
+   0                  SDFSPackHeader, padded to one sector
+   512                slotCount * SDFSPackSlot
+   dataStart          blob data, appended at dataEnd
+   capacity           end of the preallocated file
+
+ Replacing or removing a blob leaves its old data behind; the space is
+ only reclaimed by rebuilding the pack.
+
+ This library is free software; you can redistribute it and/or
+ modify it under the terms of the GNU Lesser General Public
+ License as published by the Free Software Foundation; either
+ version 2.1 of the License, or (at your option) any later version.
+
+ This library is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ Lesser General Public License for more details.
+
+ You should have received a copy of the GNU Lesser General Public
+ License along with this library; if not, write to the Free Software
+ Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+#include "SDFS.h"
+
+namespace sdfs {
+
+class SDFSPackFileImpl;
+class SDFSPackDirImpl;
+
+struct SDFSPackHeader
+{
+    uint32_t magic;
+    uint16_t version;
+    uint16_t slotSize;
+    uint32_t slotCount;  // Always a power of two
+    uint32_t dataStart;
+    uint32_t dataEnd;    // Next append position
+    uint32_t capacity;
+    uint32_t liveCount;
+};
+
+struct SDFSPackSlot
+{
+    uint32_t hash;
+    uint32_t offset;
+    uint32_t length;
+    uint8_t  state;
+    uint8_t  nameLen;
+    uint16_t reserved;
+    char     name[48];
+};
+
+class SDFSPack : public std::enable_shared_from_this<SDFSPack>
+{
+public:
+    enum { MAGIC = 0x4b504453, VERSION = 1 };  // "SDPK"
+    enum { SLOT_EMPTY = 0, SLOT_LIVE = 1, SLOT_DELETED = 2 };
+    enum { MAX_KEY = sizeof(((SDFSPackSlot *)0)->name) - 1 };
+    enum { SLOTS_PER_SECTOR = 512 / sizeof(SDFSPackSlot) };
+
+    SDFSPack(SDFSImpl *fs, const char *mountPoint);
+    ~SDFSPack();
+
+    bool begin(const char *packPath, uint32_t capacity, uint32_t maxEntries);
+    void close();
+
+    // Returns the key if path lives under our mount point ("" for the
+    // mount point itself), else nullptr
+    const char *match(const char *path) const;
+    const char *mountPoint() const {
+        return _mountPoint.get();
+    }
+
+    fs::FileImplPtr open(const char *key, OpenMode openMode, AccessMode accessMode);
+    fs::DirImplPtr openDir();
+    bool exists(const char *key);
+    bool remove(const char *key);
+    bool rename(const char *keyFrom, const char *keyTo);
+
+protected:
+    friend class SDFSPackFileImpl;
+    friend class SDFSPackDirImpl;
+
+    int32_t _find(const char *key, uint32_t *freeSlot);
+    bool _readSlot(uint32_t idx, SDFSPackSlot *slot);
+    bool _writeSlot(uint32_t idx, const SDFSPackSlot *slot);
+    bool _writeHeader();
+    bool _readAt(uint32_t offset, void *buf, size_t len);
+    bool _writeAt(uint32_t offset, const void *buf, size_t len);
+    bool _moveToTail(SDFSPackSlot *slot);
+    bool _commit(SDFSPackFileImpl *f);
+
+    SDFSImpl              *_fs;
+    std::shared_ptr<char>  _mountPoint;
+    ::File                 _fd;
+    bool                   _valid;
+    bool                   _readOnly;    // Opened O_RDONLY, blobs can only be read
+    SDFSPackHeader         _hdr;
+    uint8_t                _slotBuf[512];
+    int32_t                _slotSector;  // Which table sector _slotBuf holds
+    SDFSPackFileImpl      *_writer;      // Only one blob may grow at a time
+};
+
+class SDFSPackFileImpl : public fs::FileImpl
+{
+public:
+    SDFSPackFileImpl(std::shared_ptr<SDFSPack> pack, const char *fullName, const char *key,
+                     uint32_t offset, uint32_t length, bool writing)
+        : _pack(pack), _offset(offset), _length(length), _pos(0), _writing(writing),
+          _dirty(false), _opened(true)
+    {
+        _name = std::shared_ptr<char>(new char[strlen(fullName) + 1], std::default_delete<char[]>());
+        strcpy(_name.get(), fullName);
+        strncpy(_key, key, sizeof(_key) - 1);
+        _key[sizeof(_key) - 1] = 0;
+    }
+
+    ~SDFSPackFileImpl() override
+    {
+        close();
+    }
+
+    size_t write(const uint8_t *buf, size_t size) override;
+    size_t read(uint8_t* buf, size_t size) override;
+    void flush() override;
+    bool seek(uint32_t pos, fs::SeekMode mode) override;
+
+    size_t position() const override
+    {
+        return _opened ? _pos : 0;
+    }
+
+    size_t size() const override
+    {
+        return _opened ? _length : 0;
+    }
+
+    bool truncate(uint32_t size) override;
+    void close() override;
+
+    const char* name() const override
+    {
+        return _opened ? _key : nullptr;
+    }
+
+    const char* fullName() const override
+    {
+        return _opened ? _name.get() : nullptr;
+    }
+
+    bool isFile() const override
+    {
+        return _opened;
+    }
+
+    bool isDirectory() const override
+    {
+        return false;
+    }
+
+protected:
+    friend class SDFSPack;
+    std::shared_ptr<SDFSPack> _pack;
+    std::shared_ptr<char>     _name;
+    char                      _key[SDFSPack::MAX_KEY + 1];
+    uint32_t                  _offset;
+    uint32_t                  _length;
+    uint32_t                  _pos;
+    bool                      _writing;
+    bool                      _dirty;
+    bool                      _opened;
+};
+
+class SDFSPackDirImpl : public fs::DirImpl
+{
+public:
+    SDFSPackDirImpl(std::shared_ptr<SDFSPack> pack) : _pack(pack), _next(0), _valid(false)
+    {
+    }
+
+    fs::FileImplPtr openFile(OpenMode openMode, AccessMode accessMode) override
+    {
+        return _valid ? _pack->open(_key, openMode, accessMode) : fs::FileImplPtr();
+    }
+
+    const char* fileName() override
+    {
+        return _valid ? _key : nullptr;
+    }
+
+    size_t fileSize() override
+    {
+        return _valid ? _slot.length : 0;
+    }
+
+    bool isFile() const override
+    {
+        return _valid;
+    }
+
+    bool isDirectory() const override
+    {
+        return false;
+    }
+
+    bool next() override;
+
+    bool rewind() override
+    {
+        _valid = false;
+        _next = 0;
+        return true;
+    }
+
+protected:
+    std::shared_ptr<SDFSPack> _pack;
+    uint32_t                  _next;
+    bool                      _valid;
+    SDFSPackSlot              _slot;
+    char                      _key[SDFSPack::MAX_KEY + 1];
+};
+
+}; // namespace sdfs
+
+#endif // SDFSPack.h
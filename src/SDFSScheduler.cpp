@@ -0,0 +1,336 @@
+/*
+ SDFSScheduler.cpp - sector I/O scheduler with read priority
+
+ This library is free software; you can redistribute it and/or
+ modify it under the terms of the GNU Lesser General Public
+ License as published by the Free Software Foundation; either
+ version 2.1 of the License, or (at your option) any later version.
+
+ This library is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ Lesser General Public License for more details.
+
+ You should have received a copy of the GNU Lesser General Public
+ License along with this library; if not, write to the Free Software
+ Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+#include <stdlib.h>
+#include <string.h>
+#include "SDFSScheduler.h"
+
+namespace sdfs {
+
+SDFSScheduler::SDFSScheduler(SDFSSchedulerBackend *backend, Clock clock)
+    : _backend(backend), _clock(clock), _maxDelay(0), _cap(0), _used(0), _since(0),
+      _lba(nullptr), _tag(nullptr), _data(nullptr), _cacheSize(0), _cacheLba(nullptr),
+      _cacheData(nullptr), _trace(nullptr), _traceLen(0),
+      _traceCount(0), _replaying(false), _replayTime(0)
+{
+    resetStats();
+}
+
+SDFSScheduler::~SDFSScheduler()
+{
+    end();
+}
+
+bool SDFSScheduler::begin(size_t sectors, uint32_t maxDelay, size_t readCache)
+{
+    if (!end()) {
+        return false;
+    }
+    _maxDelay = maxDelay;
+    if (readCache) {
+        _cacheLba = (uint32_t *)malloc(readCache * sizeof(uint32_t));
+        _cacheData = (uint8_t *)malloc(readCache * SECTOR);
+        if (!_cacheLba || !_cacheData) {
+            end();
+            return false;
+        }
+        memset(_cacheLba, 0xff, readCache * sizeof(uint32_t));
+        _cacheSize = readCache;
+    }
+    if (!sectors) {
+        return true;
+    }
+    _lba = (uint32_t *)malloc(sectors * sizeof(uint32_t));
+    _tag = (uint8_t *)malloc(sectors);
+    _data = (uint8_t *)malloc(sectors * SECTOR);
+    if (!_lba || !_tag || !_data) {
+        end();
+        return false;
+    }
+    _cap = sectors;
+    return true;
+}
+
+bool SDFSScheduler::end()
+{
+    bool ok = flush();
+    free(_lba);
+    free(_tag);
+    free(_data);
+    free(_cacheLba);
+    free(_cacheData);
+    _lba = nullptr;
+    _tag = nullptr;
+    _data = nullptr;
+    _cacheLba = nullptr;
+    _cacheData = nullptr;
+    _cacheSize = 0;
+    _cap = 0;
+    _used = 0;
+    return ok;
+}
+
+void SDFSScheduler::resetStats()
+{
+    memset(&_stats, 0, sizeof(_stats));
+}
+
+void SDFSScheduler::setTrace(SDFSTraceOp *buf, size_t len)
+{
+    _trace = buf;
+    _traceLen = buf ? len : 0;
+    _traceCount = 0;
+}
+
+void SDFSScheduler::_record(uint8_t op, uint32_t sector, size_t ns, uint8_t tag)
+{
+    if (_replaying || (_traceCount >= _traceLen)) {
+        return;
+    }
+    SDFSTraceOp &t = _trace[_traceCount++];
+    t.time = _now();
+    t.sector = sector;
+    t.count = ns;
+    t.op = op;
+    t.tag = tag;
+}
+
+size_t SDFSScheduler::_lowerBound(uint32_t sector) const
+{
+    size_t lo = 0, hi = _used;
+    while (lo < hi) {
+        size_t mid = (lo + hi) / 2;
+        if (_lba[mid] < sector) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+// Forgets queued copies of sectors that are about to be overwritten
+void SDFSScheduler::_drop(uint32_t sector, size_t ns)
+{
+    size_t first = _lowerBound(sector);
+    size_t last = first;
+    while ((last < _used) && (_lba[last] - sector < ns)) {
+        last++;
+    }
+    size_t tail = _used - last;
+    if (first == last) {
+        return;
+    }
+    memmove(_lba + first, _lba + last, tail * sizeof(uint32_t));
+    memmove(_tag + first, _tag + last, tail);
+    memmove(_data + first * SECTOR, _data + last * SECTOR, tail * SECTOR);
+    _used -= last - first;
+}
+
+// Drops read cache copies of sectors that are being written
+void SDFSScheduler::forget(uint32_t sector, size_t ns)
+{
+    if (!_cacheSize) {
+        return;
+    }
+    if (ns >= _cacheSize) {
+        memset(_cacheLba, 0xff, _cacheSize * sizeof(uint32_t));
+        return;
+    }
+    for (size_t n = 0; n < ns; n++) {
+        size_t slot = (sector + n) % _cacheSize;
+        if (_cacheLba[slot] == sector + n) {
+            _cacheLba[slot] = UINT32_MAX;
+        }
+    }
+}
+
+bool SDFSScheduler::read(uint32_t sector, uint8_t *dst, size_t ns)
+{
+    _record(OP_READ, sector, ns, 0);
+    size_t slot = _cacheSize ? sector % _cacheSize : 0;
+    if ((ns == 1) && _cacheSize && (_cacheLba[slot] == sector)) {
+        memcpy(dst, _cacheData + slot * SECTOR, SECTOR);
+        _stats.cacheReads++;
+        return poll();
+    }
+    size_t first = _lowerBound(sector);
+    size_t last = first;
+    while ((last < _used) && (_lba[last] - sector < ns)) {
+        last++;
+    }
+    bool ok = true;
+    if (last - first == ns) {
+        // All queued, and in order with no gaps since LBAs are unique
+        memcpy(dst, _data + first * SECTOR, ns * SECTOR);
+        _stats.queueReads++;
+    } else {
+        // Straight to the card, ahead of the queued writes, then overlay
+        // whatever the queue has that's newer
+        ok = _backend->cardRead(sector, dst, ns);
+        _stats.reads++;
+        for (size_t i = first; ok && (i < last); i++) {
+            memcpy(dst + (_lba[i] - sector) * SECTOR, _data + i * SECTOR, SECTOR);
+        }
+    }
+    if (ok && (ns == 1) && _cacheSize) {
+        _cacheLba[slot] = sector;
+        memcpy(_cacheData + slot * SECTOR, dst, SECTOR);
+    }
+    return poll() && ok;
+}
+
+// One command straight to the backend, accounted under a single tag
+bool SDFSScheduler::_cardWrite(uint32_t sector, const uint8_t *src, size_t ns, uint8_t tag)
+{
+    bool ok = _backend->cardWrite(sector, src, ns);
+    _backend->cardWritten(sector, ns, tag);
+    return ok;
+}
+
+bool SDFSScheduler::write(uint32_t sector, const uint8_t *src, size_t ns, uint8_t tag)
+{
+    _record(OP_WRITE, sector, ns, tag);
+    forget(sector, ns);
+    if (!_cap) {
+        return _cardWrite(sector, src, ns, tag);
+    }
+    if (ns > _cap / 2) {
+        // Already one long command, queueing would only cost a copy
+        _drop(sector, ns);
+        _stats.directWrites++;
+        return _cardWrite(sector, src, ns, tag) && poll();
+    }
+    for (size_t n = 0; n < ns; n++) {
+        uint32_t lba = sector + n;
+        size_t i = _lowerBound(lba);
+        if ((i < _used) && (_lba[i] == lba)) {
+            memcpy(_data + i * SECTOR, src + n * SECTOR, SECTOR);
+            _tag[i] = tag;
+            _stats.sectorsAbsorbed++;
+            continue;
+        }
+        if (_used == _cap) {
+            if (!flush()) {
+                return false;
+            }
+            i = 0;
+        }
+        if (!_used) {
+            _since = _now();
+        }
+        size_t tail = _used - i;
+        memmove(_lba + i + 1, _lba + i, tail * sizeof(uint32_t));
+        memmove(_tag + i + 1, _tag + i, tail);
+        memmove(_data + (i + 1) * SECTOR, _data + i * SECTOR, tail * SECTOR);
+        _lba[i] = lba;
+        _tag[i] = tag;
+        memcpy(_data + i * SECTOR, src + n * SECTOR, SECTOR);
+        _used++;
+        _stats.sectorsQueued++;
+    }
+    return poll();
+}
+
+bool SDFSScheduler::flush()
+{
+    if (!_used) {
+        return true;
+    }
+    uint32_t waited = _now() - _since;
+    if (waited > _stats.maxWriteDelay) {
+        _stats.maxWriteDelay = waited;
+    }
+    bool ok = true;
+    for (size_t i = 0; i < _used; ) {
+        size_t j = i + 1;
+        while ((j < _used) && (_lba[j] == _lba[j - 1] + 1)) {
+            j++;
+        }
+        ok = _backend->cardWrite(_lba[i], _data + i * SECTOR, j - i) && ok;
+        _stats.flushCommands++;
+        for (size_t k = i; k < j; ) {
+            size_t m = k + 1;
+            while ((m < j) && (_tag[m] == _tag[k])) {
+                m++;
+            }
+            _backend->cardWritten(_lba[k], m - k, _tag[k]);
+            k = m;
+        }
+        i = j;
+    }
+    // A failed write can't be retried usefully, the error is reported here
+    _used = 0;
+    _stats.flushes++;
+    return ok;
+}
+
+bool SDFSScheduler::poll()
+{
+    if (_used && (_now() - _since >= _maxDelay)) {
+        return flush();
+    }
+    return true;
+}
+
+bool SDFSScheduler::sync()
+{
+    _record(OP_SYNC, 0, 0, 0);
+    bool ok = flush();
+    return _backend->cardSync() && ok;
+}
+
+bool SDFSScheduler::replay(const SDFSTraceOp *ops, size_t count)
+{
+    if (!_backend->isModel()) {
+        return false;
+    }
+    size_t most = 1;
+    for (size_t i = 0; i < count; i++) {
+        if (ops[i].count > most) {
+            most = ops[i].count;
+        }
+    }
+    uint8_t *buf = (uint8_t *)calloc(most, SECTOR);
+    if (!buf) {
+        return false;
+    }
+    bool ok = true;
+    _replaying = true;
+    for (size_t i = 0; ok && (i < count); i++) {
+        const SDFSTraceOp &t = ops[i];
+        _replayTime = t.time;
+        // Whatever polling the device did between commands
+        ok = poll();
+        switch (t.op) {
+            case OP_READ:
+                ok = ok && read(t.sector, buf, t.count);
+                break;
+            case OP_WRITE:
+                ok = ok && write(t.sector, buf, t.count, t.tag);
+                break;
+            case OP_SYNC:
+                ok = ok && sync();
+                break;
+        }
+    }
+    _replaying = false;
+    free(buf);
+    return ok;
+}
+
+}; // namespace sdfs
@@ -0,0 +1,183 @@
+#ifndef SDFSSCHEDULER_H
+#define SDFSSCHEDULER_H
+
+/*
+ SDFSScheduler.h - sector I/O scheduler with read priority
+
+ SdFat issues one sector command at a time and waits for each, so a read
+ made while a logger is streaming writes queues up behind every one of
+ them, card busy time included.  With the scheduler enabled, writes are
+ parked in a small queue kept in LBA order and reads go to the card
+ straight away, ahead of them.  A read of a sector still in the queue is
+ answered from the queue, so nothing ever sees stale data.
+
+ The queue is written out, adjacent sectors merged into multi-sector
+ commands, when it fills up, when the device is synced (every file
+ flush() and close() syncs), and once its oldest write has waited
+ maxDelay.  That deadline is checked on every command and by poll(), so
+ writes are never held back longer than that as long as something calls
+ in.  Writes too big to be worth queueing go straight to the card.
+
+ Single sector reads can also be kept in a direct mapped read cache.
+ SdFat caches one FAT and one data sector, so walking a directory or a
+ cluster chain rereads the same few sectors over and over.  Multi-sector
+ reads are bulk file data and bypass it.  Writes that come through
+ here drop whatever copies they replace.  Anything that changes the
+ card behind the scheduler's back (an erase, say) has to call forget()
+ for the sectors it touched, or reads keep returning the old data.  It
+ pays off most on volumes mounted read-only.
+
+ Nothing in here depends on Arduino or SdFat.  A host build can drive it
+ with its own backend and clock, and replay() feeds it a trace captured
+ on the device with setTrace().  tests/host does both.
+
+ This library is free software; you can redistribute it and/or
+ modify it under the terms of the GNU Lesser General Public
+ License as published by the Free Software Foundation; either
+ version 2.1 of the License, or (at your option) any later version.
+
+ This library is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ Lesser General Public License for more details.
+
+ You should have received a copy of the GNU Lesser General Public
+ License along with this library; if not, write to the Free Software
+ Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+#include <stddef.h>
+#include <stdint.h>
+
+namespace sdfs {
+
+// Where the scheduler's commands end up: the card, or a host model of one
+class SDFSSchedulerBackend
+{
+public:
+    virtual ~SDFSSchedulerBackend() { }
+    virtual bool cardRead(uint32_t sector, uint8_t *dst, size_t ns) = 0;
+    virtual bool cardWrite(uint32_t sector, const uint8_t *src, size_t ns) = 0;
+    // Called after each cardWrite(), once for every run of its sectors that
+    // share a tag, with the tag passed to SDFSScheduler::write() for them.
+    // Tags are only for accounting and never split a write.
+    virtual void cardWritten(uint32_t sector, size_t ns, uint8_t tag)
+    {
+        (void)sector;
+        (void)ns;
+        (void)tag;
+    }
+    virtual bool cardSync() = 0;
+    // True for host models of a card.  Only those can replay() a trace,
+    // since replaying writes zeros over every sector in it.
+    virtual bool isModel() const
+    {
+        return false;
+    }
+};
+
+struct SDFSTraceOp
+{
+    uint32_t time;     // Clock value when the command came in
+    uint32_t sector;
+    uint16_t count;
+    uint8_t  op;       // SDFSScheduler::OP_*
+    uint8_t  tag;
+};
+
+struct SDFSSchedulerStats
+{
+    uint32_t reads;          // Read commands sent to the card
+    uint32_t queueReads;     // Reads answered entirely from the queue
+    uint32_t sectorsQueued;
+    uint32_t sectorsAbsorbed; // Rewritten while still queued, so written once
+    uint32_t directWrites;   // Too big to queue
+    uint32_t flushes;
+    uint32_t flushCommands;  // Merged write commands the flushes took, tags regardless
+    uint32_t maxWriteDelay;  // Longest any queued write waited, in clock ticks
+    uint32_t cacheReads;     // Reads answered from the read cache
+};
+
+class SDFSScheduler
+{
+public:
+    enum { OP_READ = 'R', OP_WRITE = 'W', OP_SYNC = 'S' };
+    enum { SECTOR = 512 };
+
+    typedef uint32_t (*Clock)();
+
+    SDFSScheduler(SDFSSchedulerBackend *backend, Clock clock);
+    ~SDFSScheduler();
+
+    // Queue up to sectors writes for at most maxDelay clock ticks, and
+    // cache up to readCache sectors that were read.  With both 0 every
+    // command passes straight through.
+    bool begin(size_t sectors, uint32_t maxDelay, size_t readCache = 0);
+    // Writes out and frees the queue and the read cache
+    bool end();
+
+    bool enabled() const {
+        return _cap != 0;
+    }
+    size_t pending() const {
+        return _used;
+    }
+
+    bool read(uint32_t sector, uint8_t *dst, size_t ns);
+    bool write(uint32_t sector, const uint8_t *src, size_t ns, uint8_t tag = 0);
+    // Everything queued to the backend, then the backend synced
+    bool sync();
+    // Everything queued to the backend
+    bool flush();
+    // Flushes if the oldest queued write is due
+    bool poll();
+    // Drops cached copies of sectors changed without going through write()
+    void forget(uint32_t sector, size_t ns);
+
+    const SDFSSchedulerStats &stats() const {
+        return _stats;
+    }
+    void resetStats();
+
+    // Record incoming commands into buf until it's full
+    void setTrace(SDFSTraceOp *buf, size_t len);
+    size_t traceCount() const {
+        return _traceCount;
+    }
+
+    // Runs a captured trace through the scheduler, with the clock taken
+    // from the trace.  Data is zeros.  Fails unless the backend is a
+    // model, see tests/host.
+    bool replay(const SDFSTraceOp *ops, size_t count);
+
+protected:
+    uint32_t _now() const {
+        return _replaying ? _replayTime : _clock();
+    }
+    size_t _lowerBound(uint32_t sector) const;
+    void _drop(uint32_t sector, size_t ns);
+    void _record(uint8_t op, uint32_t sector, size_t ns, uint8_t tag);
+    bool _cardWrite(uint32_t sector, const uint8_t *src, size_t ns, uint8_t tag);
+
+    SDFSSchedulerBackend *_backend;
+    Clock                 _clock;
+    uint32_t              _maxDelay;
+    size_t                _cap;
+    size_t                _used;
+    uint32_t              _since;    // When the queue last went from empty to not
+    uint32_t             *_lba;      // Sorted, no duplicates
+    uint8_t              *_tag;
+    uint8_t              *_data;     // In the same order, so runs are contiguous
+    size_t                _cacheSize;
+    uint32_t             *_cacheLba; // Slot is sector % _cacheSize, UINT32_MAX if empty
+    uint8_t              *_cacheData;
+    SDFSSchedulerStats    _stats;
+    SDFSTraceOp          *_trace;
+    size_t                _traceLen;
+    size_t                _traceCount;
+    bool                  _replaying;
+    uint32_t              _replayTime;
+};
+
+}; // namespace sdfs
+
+#endif // SDFSScheduler.h
@@ -0,0 +1,39 @@
+/*
+ SDFSTime.cpp - FAT directory timestamps to time_t
+
+ This library is free software; you can redistribute it and/or
+ modify it under the terms of the GNU Lesser General Public
+ License as published by the Free Software Foundation; either
+ version 2.1 of the License, or (at your option) any later version.
+
+ This library is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ Lesser General Public License for more details.
+
+ You should have received a copy of the GNU Lesser General Public
+ License along with this library; if not, write to the Free Software
+ Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+#include "SDFSTime.h"
+
+namespace sdfs {
+
+static const uint16_t _daysBeforeMonth[13] = {
+    0, 0, 31, 59, 90, 120, 151, 181, 212, 243, 273, 304, 334
+};
+
+time_t fatToTimeT(uint16_t d, uint16_t t)
+{
+    uint32_t year = (d >> 9) & 0x7f;    // Since 1980, so 2100 is the only century
+    uint32_t month = (d >> 5) & 0x0f;
+    bool leap = !(year & 3) && (year != 120);
+    // 3652 days from 1970 to 1980, then 1980 and every fourth year after it
+    // are leap, except 2100
+    int32_t days = 3652 + year * 365 + (year + 3) / 4 - (year > 120 ? 1 : 0);
+    days += _daysBeforeMonth[month > 12 ? 12 : month] + ((leap && (month > 2)) ? 1 : 0);
+    days += (int32_t)(d & 0x1f) - 1;
+    return (time_t)days * 86400 + ((t >> 11) & 0x1f) * 3600 + ((t >> 5) & 0x3f) * 60 + ((t << 1) & 0x3e);
+}
+
+}; // namespace sdfs
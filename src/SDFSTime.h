@@ -0,0 +1,42 @@
+#ifndef SDFSTIME_H
+#define SDFSTIME_H
+
+/*
+ SDFSTime.h - FAT directory timestamps to time_t
+
+ FAT keeps dates as 7 bits of years since 1980, a month and a day, and
+ times to the even second.  Decoding them is plain arithmetic on a
+ days-before-month table, the same result TimeLib's makeTime() gives on
+ the broken out fields without its loops over years and months.
+
+ Nothing in here depends on Arduino or SdFat, so tests/host checks it
+ against a copy of makeTime() and against timegm().
+
+ This library is free software; you can redistribute it and/or
+ modify it under the terms of the GNU Lesser General Public
+ License as published by the Free Software Foundation; either
+ version 2.1 of the License, or (at your option) any later version.
+
+ This library is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ Lesser General Public License for more details.
+
+ You should have received a copy of the GNU Lesser General Public
+ License along with this library; if not, write to the Free Software
+ Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+#include <stdint.h>
+#include <time.h>
+
+namespace sdfs {
+
+// Seconds since 1970 for a FAT date and time.  Month 0 counts as
+// January, as it does for makeTime(), and months past 12 as December.
+// There is no bulk variant: listings come through SdFat one entry at a
+// time, so nothing in the tree has a batch of stamps to decode at once.
+time_t fatToTimeT(uint16_t date, uint16_t time);
+
+}; // namespace sdfs
+
+#endif // SDFSTime.h
@@ -0,0 +1,151 @@
+/*
+ test_fattime.cpp - host test for the FAT timestamp decoder
+
+ Checks fatToTimeT() against a copy of TimeLib's makeTime() for every
+ FAT date with months 0-12 over a spread of times, and against timegm()
+ for every valid date from 1980 to 2107.
+
+ This library is free software; you can redistribute it and/or
+ modify it under the terms of the GNU Lesser General Public
+ License as published by the Free Software Foundation; either
+ version 2.1 of the License, or (at your option) any later version.
+
+ This library is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ Lesser General Public License for more details.
+
+ You should have received a copy of the GNU Lesser General Public
+ License along with this library; if not, write to the Free Software
+ Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include "SDFSTime.h"
+
+using namespace sdfs;
+
+static int failures;
+#define CHECK(cond, ...) do { if (!(cond)) { printf("FAIL %s:%d: ", __FILE__, __LINE__); printf(__VA_ARGS__); printf("\n"); failures++; } } while (0)
+
+// TimeLib's makeTime(), as shipped, with its fields and macros
+struct tmElements_t {
+    uint8_t Second;
+    uint8_t Minute;
+    uint8_t Hour;
+    uint8_t Wday;
+    uint8_t Day;
+    uint8_t Month;
+    uint8_t Year;   // Offset from 1970
+};
+
+#define SECS_PER_MIN  ((time_t)(60UL))
+#define SECS_PER_HOUR ((time_t)(3600UL))
+#define SECS_PER_DAY  ((time_t)(SECS_PER_HOUR * 24UL))
+#define LEAP_YEAR(Y)  (((1970 + (Y)) > 0) && !((1970 + (Y)) % 4) && (((1970 + (Y)) % 100) || !((1970 + (Y)) % 400)))
+
+static const uint8_t monthDays[] = {31, 28, 31, 30, 31, 30, 31, 31, 30, 31, 30, 31};
+
+static time_t makeTime(const tmElements_t &tm)
+{
+    int i;
+    uint32_t seconds;
+
+    seconds = tm.Year * (SECS_PER_DAY * 365);
+    for (i = 0; i < tm.Year; i++) {
+        if (LEAP_YEAR(i)) {
+            seconds += SECS_PER_DAY;
+        }
+    }
+    for (i = 1; i < tm.Month; i++) {
+        if ((i == 2) && LEAP_YEAR(tm.Year)) {
+            seconds += SECS_PER_DAY * 29;
+        } else {
+            seconds += SECS_PER_DAY * monthDays[i - 1];
+        }
+    }
+    seconds += (tm.Day - 1) * SECS_PER_DAY;
+    seconds += tm.Hour * SECS_PER_HOUR;
+    seconds += tm.Minute * SECS_PER_MIN;
+    seconds += tm.Second;
+    return (time_t)seconds;
+}
+
+static uint16_t fatDate(unsigned year, unsigned month, unsigned day)
+{
+    return (uint16_t)(((year - 1980) << 9) | (month << 5) | day);
+}
+
+static uint16_t fatTime(unsigned hour, unsigned minute, unsigned second)
+{
+    return (uint16_t)((hour << 11) | (minute << 5) | (second >> 1));
+}
+
+// Every field the FAT encoding can hold, bar months 13-15 which
+// makeTime() would read past monthDays for.  makeTime() counts in 32
+// bits and wraps from 2106-02-07 on, so compare in 32 bits.
+static void againstMakeTime()
+{
+    static const unsigned times[][3] = {
+        {0, 0, 0}, {0, 0, 2}, {12, 34, 56}, {23, 59, 58}, {31, 63, 62}
+    };
+    for (unsigned year = 1980; year <= 2107; year++) {
+        for (unsigned month = 0; month <= 12; month++) {
+            for (unsigned day = 0; day <= 31; day++) {
+                for (auto &t : times) {
+                    tmElements_t te;
+                    memset(&te, 0, sizeof(te));
+                    te.Year = year - 1970;
+                    te.Month = month;
+                    te.Day = day;
+                    te.Hour = t[0];
+                    te.Minute = t[1];
+                    te.Second = t[2];
+                    time_t want = makeTime(te);
+                    time_t got = fatToTimeT(fatDate(year, month, day), fatTime(t[0], t[1], t[2]));
+                    CHECK((uint32_t)got == (uint32_t)want, "%04u-%02u-%02u %02u:%02u:%02u gave %lld, makeTime %lld",
+                          year, month, day, t[0], t[1], t[2], (long long)got, (long long)want);
+                }
+            }
+        }
+    }
+}
+
+static void againstTimegm()
+{
+    for (unsigned year = 1980; year <= 2107; year++) {
+        for (unsigned month = 1; month <= 12; month++) {
+            for (unsigned day = 1; day <= 31; day++) {
+                struct tm tm;
+                memset(&tm, 0, sizeof(tm));
+                tm.tm_year = year - 1900;
+                tm.tm_mon = month - 1;
+                tm.tm_mday = day;
+                tm.tm_hour = day % 24;
+                tm.tm_min = (day * 7) % 60;
+                tm.tm_sec = (day * 2) % 60;
+                time_t want = timegm(&tm);
+                if (tm.tm_mday != (int)day) {
+                    // Past the end of the month
+                    continue;
+                }
+                time_t got = fatToTimeT(fatDate(year, month, day), fatTime(day % 24, (day * 7) % 60, (day * 2) % 60));
+                CHECK(got == want, "%04u-%02u-%02u gave %lld, timegm %lld",
+                      year, month, day, (long long)got, (long long)want);
+            }
+        }
+    }
+}
+
+int main()
+{
+    againstMakeTime();
+    againstTimegm();
+    if (failures) {
+        printf("%d failures\n", failures);
+        return 1;
+    }
+    printf("OK\n");
+    return 0;
+}
@@ -0,0 +1,152 @@
+/*
+ test_lz4.cpp - host test for the LZ4 block coder
+
+ Round-trips blocks of every kind compressed files see (zeros, text,
+ sensor-like records, runs that overlap their own output, noise) at
+ every length up to a full block, checks that the compressor gives up
+ rather than overrun a short output buffer, and that the decompressor
+ rejects damaged input without writing past its buffer.
+
+ This library is free software; you can redistribute it and/or
+ modify it under the terms of the GNU Lesser General Public
+ License as published by the Free Software Foundation; either
+ version 2.1 of the License, or (at your option) any later version.
+
+ This library is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ Lesser General Public License for more details.
+
+ You should have received a copy of the GNU Lesser General Public
+ License along with this library; if not, write to the Free Software
+ Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+#include <stdio.h>
+#include <string.h>
+#include <random>
+#include <vector>
+#include "SDFSLZ4.h"
+
+using namespace sdfs;
+
+static int failures;
+#define CHECK(cond, ...) do { if (!(cond)) { printf("FAIL %s:%d: ", __FILE__, __LINE__); printf(__VA_ARGS__); printf("\n"); failures++; } } while (0)
+
+enum { BLOCK = 4096, GUARD = 64 };
+
+static uint16_t table[1 << LZ4_HASH_BITS];
+
+static std::vector<uint8_t> sample(int kind, size_t len, std::mt19937 &rnd)
+{
+    std::vector<uint8_t> v(len);
+    for (size_t i = 0; i < len; i++) {
+        switch (kind) {
+        case 0:
+            v[i] = 0;
+            break;
+        case 1:
+            v[i] = "the quick brown fox jumps over the lazy dog, "[i % 45];
+            break;
+        case 2:
+            // Timestamped records with slowly changing readings
+            v[i] = (i % 16 < 4) ? (uint8_t)((i / 16) >> ((i % 4) * 8)) : (uint8_t)((i / 512) + (i % 16));
+            break;
+        case 3:
+            // Short period runs, matches overlap their own output
+            v[i] = (uint8_t)(i % 3);
+            break;
+        case 4:
+            v[i] = rnd();
+            break;
+        default:
+            // Noise with repeats sprinkled in
+            v[i] = (i > 64 && (rnd() % 4)) ? v[i - 64 + rnd() % 8] : (uint8_t)rnd();
+            break;
+        }
+    }
+    return v;
+}
+
+static void roundTrips()
+{
+    std::mt19937 rnd(7);
+    static uint8_t comp[BLOCK + GUARD], out[BLOCK + GUARD];
+    size_t lens[] = {0, 1, 4, 5, 12, 13, 14, 15, 16, 19, 20, 270, 271, 511, 512, 1000, 4095, 4096};
+    for (int kind = 0; kind < 6; kind++) {
+        for (size_t len : lens) {
+            std::vector<uint8_t> src = sample(kind, len, rnd);
+            // Room for the worst case, literals plus their length bytes
+            size_t cap = len + len / 255 + 16;
+            size_t n = lz4CompressBlock(src.data(), len, comp, cap, table);
+            CHECK(n > 0 && n <= cap, "kind %d len %zu compressed to %zu", kind, len, n);
+            memset(out, 0xa5, sizeof(out));
+            int got = lz4DecompressBlock(comp, n, out, len);
+            CHECK(got == (int)len, "kind %d len %zu decompressed to %d", kind, len, got);
+            CHECK(!memcmp(out, src.data(), len), "kind %d len %zu data differs", kind, len);
+            CHECK(out[len] == 0xa5, "kind %d len %zu wrote past the output", kind, len);
+            if ((kind < 4) && (len == BLOCK)) {
+                CHECK(n < len / 2, "kind %d only compressed to %zu", kind, n);
+            }
+        }
+    }
+}
+
+// Noise can't be compressed; the coder must say so and stay inside cap
+static void shortOutput()
+{
+    std::mt19937 rnd(11);
+    std::vector<uint8_t> src = sample(4, BLOCK, rnd);
+    static uint8_t comp[BLOCK + GUARD];
+    memset(comp, 0xa5, sizeof(comp));
+    size_t n = lz4CompressBlock(src.data(), BLOCK, comp, BLOCK - 4, table);
+    CHECK(n == 0, "incompressible block came out as %zu bytes", n);
+    for (size_t i = BLOCK - 4; i < sizeof(comp); i++) {
+        CHECK(comp[i] == 0xa5, "wrote byte %zu with cap %d", i, BLOCK - 4);
+    }
+}
+
+static void damagedInput()
+{
+    std::mt19937 rnd(13);
+    std::vector<uint8_t> src = sample(2, BLOCK, rnd);
+    static uint8_t comp[BLOCK + GUARD], out[BLOCK + GUARD];
+    size_t n = lz4CompressBlock(src.data(), BLOCK, comp, sizeof(comp), table);
+    CHECK(n > 0, "compress failed");
+
+    // Too small an output buffer
+    memset(out, 0xa5, sizeof(out));
+    CHECK(lz4DecompressBlock(comp, n, out, BLOCK - 1) < 0, "decoded into a short buffer");
+    CHECK(out[BLOCK - 1] == 0xa5, "wrote past a short buffer");
+
+    // Cut short anywhere, and random damage, must never go out of bounds
+    for (size_t cut = 0; cut < n; cut += 7) {
+        int got = lz4DecompressBlock(comp, cut, out, BLOCK);
+        CHECK(got <= BLOCK, "truncated to %zu decoded %d bytes", cut, got);
+    }
+    for (int i = 0; i < 2000; i++) {
+        std::vector<uint8_t> bad(comp, comp + n);
+        bad[rnd() % n] ^= 1 << (rnd() % 8);
+        memset(out, 0xa5, sizeof(out));
+        int got = lz4DecompressBlock(bad.data(), n, out, BLOCK);
+        CHECK(got <= BLOCK && out[BLOCK] == 0xa5, "damaged input decoded %d bytes", got);
+    }
+
+    // A match reaching back before the start of the output
+    uint8_t early[] = {0x10, 'a', 0x02, 0x00, 0x00};
+    CHECK(lz4DecompressBlock(early, sizeof(early), out, BLOCK) < 0, "match before the start accepted");
+    uint8_t zero[] = {0x10, 'a', 0x00, 0x00, 0x00};
+    CHECK(lz4DecompressBlock(zero, sizeof(zero), out, BLOCK) < 0, "zero match offset accepted");
+}
+
+int main()
+{
+    roundTrips();
+    shortOutput();
+    damagedInput();
+    if (failures) {
+        printf("%d failures\n", failures);
+        return 1;
+    }
+    printf("OK\n");
+    return 0;
+}
@@ -0,0 +1,265 @@
+/*
+ test_scheduler.cpp - host test for SDFSScheduler
+
+ Drives the scheduler with a random mix of logger style writes, metadata
+ rewrites and reads against an in-memory card model, and checks that no
+ read ever sees stale data, that the card ends up identical to the model,
+ that writes are merged and never held past the delay bound, that the
+ read cache stays coherent, and that captured traces replay only on a
+ model.
+
+ This library is free software; you can redistribute it and/or
+ modify it under the terms of the GNU Lesser General Public
+ License as published by the Free Software Foundation; either
+ version 2.1 of the License, or (at your option) any later version.
+
+ This library is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ Lesser General Public License for more details.
+
+ You should have received a copy of the GNU Lesser General Public
+ License along with this library; if not, write to the Free Software
+ Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+#include <stdio.h>
+#include <string.h>
+#include <map>
+#include <random>
+#include <vector>
+#include "SDFSScheduler.h"
+
+using namespace sdfs;
+
+typedef std::map<uint32_t, std::vector<uint8_t>> Sectors;
+
+static uint32_t _clock;
+static uint32_t testClock()
+{
+    return _clock;
+}
+
+static int failures;
+#define CHECK(cond, ...) do { if (!(cond)) { printf("FAIL %s:%d: ", __FILE__, __LINE__); printf(__VA_ARGS__); printf("\n"); failures++; } } while (0)
+
+// Sectors never written read as zeros
+class ModelCard : public SDFSSchedulerBackend
+{
+public:
+    ModelCard(bool model = true) : _model(model), reads(0), writes(0), sectorsWritten(0) {
+        memset(taggedSectors, 0, sizeof(taggedSectors));
+    }
+
+    bool cardRead(uint32_t sector, uint8_t *dst, size_t ns) override
+    {
+        reads++;
+        for (size_t i = 0; i < ns; i++) {
+            auto it = sectors.find(sector + i);
+            if (it == sectors.end()) {
+                memset(dst + i * 512, 0, 512);
+            } else {
+                memcpy(dst + i * 512, it->second.data(), 512);
+            }
+        }
+        return true;
+    }
+
+    bool cardWrite(uint32_t sector, const uint8_t *src, size_t ns) override
+    {
+        writes++;
+        sectorsWritten += ns;
+        for (size_t i = 0; i < ns; i++) {
+            sectors[sector + i].assign(src + i * 512, src + (i + 1) * 512);
+        }
+        return true;
+    }
+
+    void cardWritten(uint32_t sector, size_t ns, uint8_t tag) override
+    {
+        (void)sector;
+        taggedSectors[tag & 3] += ns;
+    }
+
+    bool cardSync() override
+    {
+        return true;
+    }
+
+    bool isModel() const override
+    {
+        return _model;
+    }
+
+    bool     _model;
+    Sectors  sectors;
+    uint32_t reads;
+    uint32_t writes;
+    uint32_t sectorsWritten;
+    uint32_t taggedSectors[4];
+};
+
+static void put(Sectors &model, uint32_t lba, const std::vector<uint8_t> &buf)
+{
+    for (size_t i = 0; i < buf.size() / 512; i++) {
+        model[lba + i].assign(buf.begin() + i * 512, buf.begin() + (i + 1) * 512);
+    }
+}
+
+static bool matches(const Sectors &model, uint32_t lba, const uint8_t *buf, size_t ns)
+{
+    for (size_t i = 0; i < ns; i++) {
+        auto it = model.find(lba + i);
+        std::vector<uint8_t> want(512, 0);
+        if (it != model.end()) {
+            want = it->second;
+        }
+        if (memcmp(want.data(), buf + i * 512, 512)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// A logger appending to one file while the FAT and directory sectors near
+// the start of the card are rewritten and read back.  Each write is
+// tagged at random, as data or metadata would be.
+static void randomMix(size_t queue, uint32_t maxDelay, size_t cache, SDFSTraceOp *trace, size_t *traced)
+{
+    std::mt19937 rnd(3);
+    ModelCard card;
+    SDFSScheduler sched(&card, testClock);
+    CHECK(sched.begin(queue, maxDelay, cache), "begin(%zu, %u, %zu)", queue, maxDelay, cache);
+    if (trace) {
+        sched.setTrace(trace, 100000);
+    }
+    Sectors model;
+    uint32_t logLba = 1000;
+    uint32_t written = 0;
+    uint32_t tagged = 0;
+    _clock = 0;
+    for (int op = 0; op < 50000; op++) {
+        _clock += rnd() % 7;
+        int kind = rnd() % 10;
+        std::vector<uint8_t> buf;
+        if (kind < 5) {
+            size_t ns = 1 + ((rnd() % 3 == 0) ? rnd() % 10 : 0);
+            buf.resize(ns * 512);
+            for (auto &b : buf) {
+                b = rnd();
+            }
+            uint32_t lba = (rnd() % 4 == 0) ? 10 + rnd() % 4 : logLba;
+            if (lba == logLba) {
+                logLba += ns;
+            }
+            sched.write(lba, buf.data(), ns, rnd() % 2);
+            put(model, lba, buf);
+            written += ns;
+        } else if (kind < 9) {
+            uint32_t lba = (rnd() % 2) ? 10 + rnd() % 4 : (logLba > 20 ? logLba - 1 - rnd() % 20 : 5);
+            size_t ns = (rnd() % 2) ? 1 : 1 + rnd() % 4;
+            buf.resize(ns * 512);
+            sched.read(lba, buf.data(), ns);
+            if (!matches(model, lba, buf.data(), ns)) {
+                CHECK(false, "stale read of %u+%zu at op %d (queue %zu, cache %zu)", lba, ns, op, queue, cache);
+                return;
+            }
+        } else if (rnd() % 20 == 0) {
+            sched.sync();
+        } else {
+            sched.poll();
+        }
+    }
+    CHECK(sched.sync(), "final sync");
+    CHECK(card.sectors == model, "card differs from model (queue %zu, cache %zu)", queue, cache);
+    for (int i = 0; i < 4; i++) {
+        tagged += card.taggedSectors[i];
+    }
+    CHECK(tagged == card.sectorsWritten, "accounted %u sectors of %u written", tagged, card.sectorsWritten);
+    const SDFSSchedulerStats &st = sched.stats();
+    if (queue) {
+        CHECK(card.writes < written / 2, "%u write commands for %u sectors, expected merging", card.writes, written);
+        CHECK(st.maxWriteDelay <= maxDelay + 6, "a write waited %u, bound %u", st.maxWriteDelay, maxDelay);
+    }
+    if (cache) {
+        CHECK(st.cacheReads > 0, "read cache never hit");
+    }
+    printf("queue %2zu cache %zu: %u sectors in %u commands, max delay %u, %u cache reads\n",
+           queue, cache, written, card.writes, st.maxWriteDelay, st.cacheReads);
+    if (traced) {
+        *traced = sched.traceCount();
+    }
+}
+
+// Adjacent sectors queued under different tags still go out as one
+// command, and each tag is accounted for its own sectors
+static void mergeAcrossTags()
+{
+    ModelCard card;
+    SDFSScheduler sched(&card, testClock);
+    sched.begin(16, 1000);
+    uint8_t buf[512 * 4];
+    memset(buf, 0x5a, sizeof(buf));
+    _clock = 0;
+    sched.write(100, buf, 2, 0);
+    sched.write(102, buf, 1, 2);
+    sched.write(103, buf, 1, 0);
+    sched.flush();
+    CHECK(card.writes == 1, "%u commands for 4 adjacent sectors", card.writes);
+    CHECK((card.taggedSectors[0] == 3) && (card.taggedSectors[2] == 1), "tags split %u/%u",
+          card.taggedSectors[0], card.taggedSectors[2]);
+}
+
+// Sectors changed on the card directly, the way an erase does, stay
+// stale in the read cache until forget()
+static void forgetAfterErase()
+{
+    ModelCard card;
+    SDFSScheduler sched(&card, testClock);
+    sched.begin(0, 0, 8);
+    uint8_t buf[512];
+    memset(buf, 0x5a, sizeof(buf));
+    sched.write(7, buf, 1);
+    sched.read(7, buf, 1);
+    card.sectors.erase(7);
+    sched.read(7, buf, 1);
+    CHECK(buf[0] == 0x5a, "read cache already dropped sector 7");
+    sched.forget(5, 4);
+    sched.read(7, buf, 1);
+    CHECK(buf[0] == 0, "sector 7 still cached after forget()");
+}
+
+// A trace must never be replayed onto a real card
+static void replayNeedsModel(const SDFSTraceOp *trace, size_t n)
+{
+    ModelCard model;
+    SDFSScheduler sched(&model, testClock);
+    sched.begin(16, 50);
+    CHECK(sched.replay(trace, n), "replay of %zu ops on a model", n);
+    CHECK(sched.sync(), "sync after replay");
+    printf("replayed %zu ops: %u write commands, max delay %u\n", n, model.writes, sched.stats().maxWriteDelay);
+
+    ModelCard real(false);
+    SDFSScheduler live(&real, testClock);
+    live.begin(16, 50);
+    CHECK(!live.replay(trace, n), "replay accepted by a real card backend");
+    CHECK(real.writes == 0 && real.reads == 0, "replay touched a real card backend");
+}
+
+int main()
+{
+    static SDFSTraceOp trace[100000];
+    size_t traced = 0;
+    randomMix(0, 0, 0, nullptr, nullptr);
+    randomMix(16, 50, 0, trace, &traced);
+    randomMix(0, 0, 8, nullptr, nullptr);
+    randomMix(16, 50, 8, nullptr, nullptr);
+    mergeAcrossTags();
+    forgetAfterErase();
+    replayNeedsModel(trace, traced);
+    if (failures) {
+        printf("%d failures\n", failures);
+        return 1;
+    }
+    printf("OK\n");
+    return 0;
+}